@@ -0,0 +1,629 @@
+#include "libnebulabrotgen.h"
+#include "stb_image_write.h"
+#include "validation.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+
+//benchmarks of the rendering kernels and managers, results are written as json
+//with --validate, renders reference scenes with every kernel set and sampler variant instead and checks them
+//statistically against the reference sampler (generic kernels, mt19937), the exit code is 1 if any fails
+//usage: nebulabrotgen_bench [--quick] [--validate] [--filter substring] [--out file.json] [--tmp directory]
+
+namespace {
+
+struct BenchResult {
+  std::string name;
+  std::string params;
+  std::vector<double> times;
+  double work;
+  std::string unit;
+  std::string extra;
+};
+
+struct BenchOptions {
+  bool quick = false;
+  bool validate = false;
+  std::string filter;
+  std::string out;
+  std::string tmp = ".";
+  double min_time = 0.5;
+};
+
+std::vector<BenchResult> results;
+std::vector<std::string> validations;
+BenchOptions options;
+
+template<typename real_t>
+void func(std::complex<real_t>& z, std::complex<real_t> c) {
+  z = z * z + c;
+}
+
+void funcPerturbation(std::complex<double>& dz, std::complex<double> ref, std::complex<double> dc) {
+  dz = (2.0 * ref + dz) * dz + dc;
+}
+
+const InnerFunctionData inner_func(func<double>, func<float>, func<DoubleDouble>, funcPerturbation, 1);
+const RendererPrecision precisions[] = {PRECISION_FLOAT, PRECISION_DOUBLE, PRECISION_DOUBLE_DOUBLE};
+
+uint32_t pixelNebulabrot(double* values) {
+  return packColor(std::sqrt(values[0]), std::sqrt(values[1]), std::sqrt(values[2]));
+}
+
+void tiledMonochrome(const ImageTileInfo& tile, const uint32_t* const* counts, uint32_t* output) {
+  double scale = tile.max_values[0] > 0 ? 1.0 / tile.max_values[0] : 0;
+  for (size_t i = 0; i < tile.count; ++i) {
+    double val = std::sqrt(counts[0][i] * scale);
+    output[i] = packColor(val, val, val);
+  }
+}
+
+double secondsSince(std::chrono::steady_clock::time_point time) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - time).count();
+}
+
+bool selected(const std::string& name) {
+  return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+//runs setup (untimed) and body until min_time elapsed and at least 3 times, at most 50
+//work: amount done by one run of body, reported as work per second of the median run
+//returns false if the benchmark was filtered out
+bool bench(const std::string& name, const std::string& params, double work, const std::string& unit,
+           const std::function<void()>& setup, const std::function<void()>& body, const std::string& extra = "") {
+  if (!selected(name)) {
+    return false;
+  }
+  std::cerr<<name<<" "<<params<<"\n";
+  BenchResult result{name, params, {}, work, unit, extra};
+  double total = 0;
+  while ((total < options.min_time || result.times.size() < 3) && result.times.size() < 50) {
+    if (setup) {
+      setup();
+    }
+    auto begin = std::chrono::steady_clock::now();
+    body();
+    double time = secondsSince(begin);
+    result.times.push_back(time);
+    total += time;
+  }
+  results.push_back(result);
+  return true;
+}
+
+void fillCounts(NebulabrotChannelBuffer& buf, uint32_t seed) {
+  std::mt19937 random(seed);
+  std::uniform_int_distribution<uint32_t> dist(0, 1000);
+  uint32_t* data = buf.getData();
+  for (size_t i = 0; i < buf.getSize(); ++i) {
+    data[i] = dist(random);
+  }
+  buf.updateMaxValue();
+}
+
+NebulabrotChannelCollection syntheticCollection(size_t width, size_t height, size_t num_channels) {
+  NebulabrotChannelCollection collection(width, height);
+  for (size_t i = 0; i < num_channels; ++i) {
+    auto it = collection.channels.emplace("i" + std::to_string(i + 1), NebulabrotChannelBuffer(width, height)).first;
+    fillCounts(it->second, i + 1);
+  }
+  return collection;
+}
+
+void benchOrbits() {
+  std::vector<size_t> depths = {64, 256, 1024, 4096};
+  size_t num_points = options.quick ? 1024 : 8192;
+  std::mt19937 random(1);
+  std::uniform_real_distribution<double> dist(-2.0, 2.0);
+  std::vector<std::complex<double>> points(num_points);
+  for (auto& c : points) {
+    c = {dist(random), dist(random)};
+  }
+  for (const CpuKernels* kernels : getSupportedCpuKernels()) {
+    for (RendererPrecision precision : precisions) {
+      for (size_t depth : depths) {
+        std::unique_ptr<OrbitRenderer> renderer(kernels->createRenderer(640, 480, depth, 16, inner_func, 2.0, 256,
+                                                                        RANDOM_XOSHIRO, precision));
+        renderer->setArea(0, 0, 8);
+        size_t iterations = 0;
+        for (auto& c : points) {
+          iterations += renderer->orbitIterations(c);
+        }
+        bench("orbit", "{\"depth\": " + std::to_string(depth) + ", \"points\": " + std::to_string(num_points)
+              + ", \"kernels\": \"" + kernels->name + "\", \"precision\": \"" + precisionName(precision) + "\"}",
+              iterations, "iterations", nullptr, [&]() {
+          for (auto& c : points) {
+            renderer->orbitIterations(c);
+          }
+        });
+      }
+    }
+  }
+}
+
+void benchSplat() {
+  size_t width = options.quick ? 640 : 1920, height = options.quick ? 480 : 1080;
+  size_t iterations = options.quick ? 500 : 2000;
+  for (const CpuKernels* kernels : getSupportedCpuKernels()) {
+    for (size_t depth : {32, 256}) {
+      //generators in double, precisions with xoshiro
+      std::vector<std::pair<RandomGenerator, RendererPrecision>> variants = {
+          {RANDOM_XOSHIRO, PRECISION_DOUBLE}, {RANDOM_MT19937, PRECISION_DOUBLE},
+          {RANDOM_XOSHIRO, PRECISION_FLOAT}, {RANDOM_XOSHIRO, PRECISION_DOUBLE_DOUBLE},
+          {RANDOM_XOSHIRO, PRECISION_PERTURBATION}};
+      for (auto& variant : variants) {
+        std::unique_ptr<OrbitRenderer> renderer(kernels->createRenderer(width, height, depth, 16, inner_func, 32, 256,
+                                                                        variant.first, variant.second));
+        renderer->setArea(0, 0, 8);
+        renderer->prepareInitialPoints();
+        NebulabrotChannelBuffer buf(width, height);
+        bench("output_point_values", "{\"depth\": " + std::to_string(depth) + ", \"width\": " + std::to_string(width)
+              + ", \"height\": " + std::to_string(height) + ", \"kernels\": \"" + kernels->name + "\", \"random\": \""
+              + (variant.first == RANDOM_XOSHIRO ? "xoshiro" : "mt19937") + "\", \"precision\": \""
+              + precisionName(variant.second) + "\"}", iterations * 16, "proposals", nullptr, [&]() {
+          renderer->outputPointValues(buf.getData(), iterations);
+        });
+      }
+    }
+  }
+}
+
+void benchMerge() {
+  std::vector<std::pair<size_t, size_t>> resolutions = {{640, 480}, {1920, 1080}, {3840, 2160}};
+  if (options.quick) {
+    resolutions.pop_back();
+  }
+  std::string selected_kernels = getCpuKernels().name;
+  for (const CpuKernels* kernels : getSupportedCpuKernels()) {
+    setCpuKernels(kernels->name);
+    for (auto& res : resolutions) {
+      std::string params = "{\"width\": " + std::to_string(res.first) + ", \"height\": " + std::to_string(res.second)
+          + ", \"kernels\": \"" + kernels->name + "\"}";
+      NebulabrotChannelBuffer a(res.first, res.second), b(res.first, res.second);
+      fillCounts(a, 1);
+      fillCounts(b, 2);
+      double bytes = (double) a.getSize() * sizeof(uint32_t);
+      bench("merge_with", params, bytes, "bytes", nullptr, [&]() { a.mergeWith(b); });
+      bench("update_max_value", params, bytes, "bytes", nullptr, [&]() { a.updateMaxValue(); });
+      std::vector<double> values(a.getSize());
+      bench("scale_counts", params, bytes, "bytes", nullptr, [&]() {
+        kernels->scaleCounts(a.getData(), a.getSize(), 1.0 / 1000, values.data());
+      });
+    }
+  }
+  setCpuKernels(selected_kernels);
+}
+
+void benchImages() {
+  size_t width = options.quick ? 640 : 1920, height = options.quick ? 480 : 1080;
+  NebulabrotChannelCollection collection = syntheticCollection(width, height, 3);
+  std::string params = "{\"width\": " + std::to_string(width) + ", \"height\": " + std::to_string(height)
+      + ", \"threads\": " + std::to_string(ThreadPool::shared().getSize()) + "}";
+  std::vector<std::pair<std::string, ImageFunctionData>> modes = {
+      {"image_pixel", ImageFunctionData(pixelNebulabrot, {"i1", "i2", "i3"}, {})},
+      {"image_span", ImageFunctionData(spanNebulabrot<3, transferSqrt>, {"i1", "i2", "i3"}, {})},
+      {"image_tiled", ImageFunctionData(tiledMonochrome, {"i1"})}};
+  for (auto& mode : modes) {
+    ImageRenderingManager manager(ThreadPool::shared().getSize());
+    manager.setSaveImages(false);
+    manager.add(options.tmp + "/bench_" + mode.first, ImageOutputData(mode.second, &collection));
+    bench(mode.first, params, (double) width * height, "pixels", nullptr, [&]() { manager.execute(); });
+  }
+}
+
+void benchPng() {
+  size_t width = options.quick ? 640 : 1920, height = options.quick ? 480 : 1080;
+  //smooth gradients with noise resemble rendered images better than random bytes
+  std::vector<uint32_t> pixels(width * height);
+  std::mt19937 random(3);
+  for (size_t y = 0; y < height; ++y) {
+    for (size_t x = 0; x < width; ++x) {
+      double r = std::sqrt((double) x * y / (width * height));
+      double g = 0.5 + 0.5 * std::sin(x * 0.01) * std::cos(y * 0.013);
+      double noise = (random() % 16) / 255.0;
+      pixels[y * width + x] = packColor(std::min(1.0, r + noise), g, std::min(1.0, noise * 4));
+    }
+  }
+  std::string params = "{\"width\": " + std::to_string(width) + ", \"height\": " + std::to_string(height) + "}";
+  const char* names[] = {"store", "fast", "default", "max"};
+  for (int level = PNG_STORE; level <= PNG_MAX; ++level) {
+    size_t size = 0;
+    if (bench(std::string("png_") + names[level], params, (double) width * height * 4, "bytes", nullptr, [&]() {
+      size = encodePng(width, height, pixels.data(), (PngCompression) level).size();
+    })) {
+      results.back().extra = "\"output_bytes\": " + std::to_string(size);
+    }
+  }
+  std::vector<uint8_t> stb_output;
+  auto append = [](void* context, void* data, int size) {
+    auto* out = (std::vector<uint8_t>*) context;
+    out->insert(out->end(), (uint8_t*) data, (uint8_t*) data + size);
+  };
+  if (bench("png_stb", params, (double) width * height * 4, "bytes", [&]() { stb_output.clear(); }, [&]() {
+    stbi_write_png_to_func(append, &stb_output, width, height, 4, pixels.data(), width * 4);
+  })) {
+    results.back().extra = "\"output_bytes\": " + std::to_string(stb_output.size());
+  }
+}
+
+void benchRaw() {
+  size_t width = options.quick ? 640 : 1920, height = options.quick ? 480 : 1080;
+  NebulabrotChannelCollection collection = syntheticCollection(width, height, 3);
+  std::string filename = options.tmp + "/bench_raw";
+  double bytes = 3.0 * width * height * sizeof(uint32_t);
+  std::string params = "{\"width\": " + std::to_string(width) + ", \"height\": " + std::to_string(height)
+      + ", \"channels\": 3}";
+  bench("raw_save", params, bytes, "bytes", nullptr, [&]() { collection.saveFile(filename); });
+  bench("raw_load", params, bytes, "bytes", nullptr, [&]() {
+    NebulabrotChannelCollection loaded(width, height);
+    loaded.loadFile(filename);
+  });
+  std::remove(filename.c_str());
+}
+
+void benchScaling() {
+  size_t width = 640, height = 480;
+  size_t iterations = options.quick ? 20000 : 100000;
+  size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<size_t> thread_counts;
+  for (size_t n = 1; n < max_threads; n *= 2) {
+    thread_counts.push_back(n);
+  }
+  thread_counts.push_back(max_threads);
+  for (size_t threads : thread_counts) {
+    ThreadPool pool(threads);
+    bench("render_scaling", "{\"threads\": " + std::to_string(threads) + ", \"width\": " + std::to_string(width)
+          + ", \"height\": " + std::to_string(height) + "}", 2.0 * iterations * 16, "proposals", nullptr, [&]() {
+      NebulabrotRenderingManager manager(-0.5, 0, 4, 32, 256, width, height, threads);
+      manager.setThreadPool(&pool);
+      manager.add("i1", NebulabrotIterationData(64, iterations, inner_func));
+      manager.add("i2", NebulabrotIterationData(256, iterations, inner_func));
+      manager.execute();
+    });
+  }
+}
+
+//weighted counts rounded to whole orbit points, so that the chi-square of every estimator assumes the same noise
+void toOrbitPoints(NebulabrotChannelCollection& result) {
+  for (auto& channel : result.channels) {
+    NebulabrotChannelBuffer& buf = channel.second;
+    uint32_t scale = buf.weight_scale;
+    uint32_t* data = buf.getData();
+    for (size_t i = 0; i < buf.getSize(); ++i) {
+      data[i] = (data[i] + scale / 2) / scale;
+    }
+    buf.weight_scale = 1;
+    buf.updateMaxValue();
+  }
+}
+
+//per-pixel distance from a render 16 times longer against the time taken, for each estimator and adaptive proposals
+//at increasing lengths; adaptive chains count their states, so their render 16 times longer does too, untuned
+void benchConvergence() {
+  if (!selected("convergence")) {
+    return;
+  }
+  size_t width = 320, height = 240;
+  std::vector<size_t> lengths = {2500, 5000, 10000, 20000};
+  if (!options.quick) {
+    lengths.push_back(40000);
+    lengths.push_back(80000);
+  }
+  size_t threads = ThreadPool::shared().getSize();
+  auto render = [&](size_t iterations, SplatEstimator estimator, bool adaptive, size_t burn_in, double& time) {
+    NebulabrotRenderingManager manager(-0.75, 0.1, 0.6, 32, 256, width, height, threads);
+    NebulabrotIterationData data(256, iterations, inner_func, PRECISION_DOUBLE, estimator);
+    data.mutation.adaptive = adaptive;
+    data.mutation.burn_in = burn_in;
+    manager.add("i1", data);
+    auto begin = std::chrono::steady_clock::now();
+    NebulabrotChannelCollection result = manager.execute();
+    time = secondsSince(begin);
+    toOrbitPoints(result);
+    return result;
+  };
+  size_t burn_in = MutationParameters().burn_in;
+  double time;
+  std::cerr<<"convergence reference\n";
+  NebulabrotChannelCollection reference = render(lengths.back() * 16, SPLAT_ACCEPTED, false, 0, time);
+  std::cerr<<"convergence state reference\n";
+  NebulabrotChannelCollection state_reference = render(lengths.back() * 16, SPLAT_ACCEPTED, true, 0, time);
+  std::vector<std::pair<SplatEstimator, bool>> variants = {{SPLAT_ACCEPTED, false}, {SPLAT_EXPECTED, false},
+                                                           {SPLAT_ACCEPTED, true}};
+  for (const auto& variant : variants) {
+    SplatEstimator estimator = variant.first;
+    bool adaptive = variant.second;
+    for (size_t iterations : lengths) {
+      std::string params = "{\"estimator\": \"" + std::string(estimatorName(estimator)) + "\", \"adaptive\": "
+          + (adaptive ? "true" : "false") + ", \"iterations\": "
+          + std::to_string(iterations) + ", \"width\": " + std::to_string(width) + ", \"height\": "
+          + std::to_string(height) + "}";
+      std::cerr<<"convergence "<<params<<"\n";
+      NebulabrotChannelCollection result = render(iterations, estimator, adaptive, burn_in, time);
+      NebulabrotChannelCollection& truth = adaptive ? state_reference : reference;
+      ChannelDifference difference = compareChannels(result.channels.at("i1").getData(),
+                                                     truth.channels.at("i1").getData(), width, height, 1);
+      results.push_back({"convergence", params, {time}, 16.0 * iterations, "proposals",
+                         "\"difference\": " + difference.toJson()});
+    }
+  }
+}
+
+struct ValidationScene {
+  std::string name;
+  double xmid, ymid, factor;
+  std::vector<size_t> depths;
+  //also rendered by the perturbation renderer, its chains only move and can't explore wide views
+  bool deep;
+};
+
+//a way of rendering that should be statistically indistinguishable from its reference
+struct ValidationCandidate {
+  std::string name;
+  std::string kernels;
+  RandomGenerator generator;
+  bool deterministic;
+  RendererPrecision precision;
+  SplatEstimator estimator;
+  MutationParameters mutation;
+  //name of the reference rendered with the same proposals and estimate, see MutationParameters
+  std::string reference;
+};
+
+NebulabrotChannelCollection renderScene(const ValidationScene& scene, const ValidationCandidate& candidate,
+                                        double& time) {
+  size_t width = options.quick ? 160 : 320, height = options.quick ? 120 : 240;
+  size_t iterations = options.quick ? 20000 : 100000;
+  std::string selected_kernels = getCpuKernels().name;
+  setCpuKernels(candidate.kernels);
+  size_t threads = ThreadPool::shared().getSize();
+  NebulabrotRenderingManager manager(scene.xmid, scene.ymid, scene.factor, 32, 256, width, height, threads);
+  manager.setRandomGenerator(candidate.generator);
+  manager.setDeterministic(candidate.deterministic, 1);
+  for (size_t depth : scene.depths) {
+    NebulabrotIterationData data(depth, iterations, inner_func, candidate.precision, candidate.estimator);
+    data.mutation = candidate.mutation;
+    manager.add("d" + std::to_string(depth), data);
+  }
+  auto begin = std::chrono::steady_clock::now();
+  NebulabrotChannelCollection result = manager.execute();
+  time = secondsSince(begin);
+  setCpuKernels(selected_kernels);
+  toOrbitPoints(result);
+  return result;
+}
+
+//a deterministic channel has to stay bit-identical with another channel added and with another number of threads
+bool validateReproducibility() {
+  if (!selected("reproducible")) {
+    return true;
+  }
+  size_t width = 160, height = 120;
+  size_t iterations = options.quick ? 5000 : 20000;
+  auto render = [&](size_t threads, bool second_channel) {
+    ThreadPool pool(threads);
+    NebulabrotRenderingManager manager(-0.75, 0.1, 0.6, 32, 256, width, height, threads);
+    manager.setThreadPool(&pool);
+    manager.setDeterministic(true, 7);
+    manager.add("d64", NebulabrotIterationData(64, iterations, inner_func, PRECISION_DOUBLE));
+    if (second_channel) {
+      manager.add("d1024", NebulabrotIterationData(1024, iterations, inner_func, PRECISION_DOUBLE));
+    }
+    return manager.execute();
+  };
+  std::cerr<<"validate reproducible\n";
+  NebulabrotChannelCollection alone = render(1, false);
+  NebulabrotChannelCollection together = render(3, true);
+  NebulabrotChannelBuffer& a = alone.channels.at("d64");
+  NebulabrotChannelBuffer& b = together.channels.at("d64");
+  bool passed = std::equal(a.getData(), a.getData() + a.getSize(), b.getData());
+  validations.push_back(std::string("    {\"scene\": \"zoom\", \"candidate\": \"reproducible\", \"channel\": \"d64\", ")
+                        + "\"passed\": " + (passed ? "true" : "false")
+                        + ", \"check\": \"bit-identical alone on 1 thread and next to d1024 on 3 threads\"}");
+  return passed;
+}
+
+//returns false if any candidate differs from the references more than a reference render held out from the others
+bool runValidation() {
+  std::vector<ValidationScene> scenes = {{"full", 0, 0, 8, {32, 256}, false},
+                                         {"zoom", -0.75, 0.1, 0.6, {64, 1024}, false},
+                                         {"deep", -0.7436438870371587, 0.1318259042053120, 2e-5, {256, 1024}, true}};
+  //references with the proposals of their candidates: the perturbation renderer only moves, adaptive chains count
+  //their states, tuned or with the default proposals to check that tuning leaves the image as it is
+  MutationParameters defaults, moves, tuned, states;
+  moves.random_fraction = 0;
+  tuned.adaptive = true;
+  states.adaptive = true;
+  states.burn_in = 0;
+  std::vector<ValidationCandidate> reference_candidates = {
+      {"reference", "generic", RANDOM_MT19937, false, PRECISION_DOUBLE, SPLAT_ACCEPTED, defaults, ""},
+      {"moves_reference", "generic", RANDOM_MT19937, false, PRECISION_DOUBLE, SPLAT_ACCEPTED, moves, ""},
+      {"tuned_reference", "generic", RANDOM_MT19937, false, PRECISION_DOUBLE, SPLAT_ACCEPTED, tuned, ""},
+      {"state_reference", "generic", RANDOM_MT19937, false, PRECISION_DOUBLE, SPLAT_ACCEPTED, states, ""}};
+  std::vector<ValidationCandidate> candidates;
+  for (const CpuKernels* kernels : getSupportedCpuKernels()) {
+    candidates.push_back({std::string(kernels->name) + "_xoshiro", kernels->name, RANDOM_XOSHIRO, false,
+                          PRECISION_DOUBLE, SPLAT_ACCEPTED, defaults, "reference"});
+    candidates.push_back({std::string(kernels->name) + "_mt19937", kernels->name, RANDOM_MT19937, false,
+                          PRECISION_DOUBLE, SPLAT_ACCEPTED, defaults, "reference"});
+  }
+  std::string name = getCpuKernels().name;
+  candidates.push_back({"deterministic", name, RANDOM_XOSHIRO, true, PRECISION_DOUBLE, SPLAT_ACCEPTED, defaults,
+                        "reference"});
+  candidates.push_back({"float", name, RANDOM_XOSHIRO, false, PRECISION_FLOAT, SPLAT_ACCEPTED, defaults, "reference"});
+  candidates.push_back({"double_double", name, RANDOM_XOSHIRO, false, PRECISION_DOUBLE_DOUBLE, SPLAT_ACCEPTED, defaults,
+                        "reference"});
+  candidates.push_back({"perturbation", name, RANDOM_XOSHIRO, false, PRECISION_PERTURBATION, SPLAT_ACCEPTED, moves,
+                        "moves_reference"});
+  candidates.push_back({"expected", name, RANDOM_XOSHIRO, false, PRECISION_DOUBLE, SPLAT_EXPECTED, defaults,
+                        "reference"});
+  candidates.push_back({"adaptive", name, RANDOM_XOSHIRO, false, PRECISION_DOUBLE, SPLAT_ACCEPTED, tuned,
+                        "tuned_reference"});
+  candidates.push_back({"adaptive_proposals", name, RANDOM_XOSHIRO, false, PRECISION_DOUBLE, SPLAT_ACCEPTED, tuned,
+                        "state_reference"});
+  bool all_passed = true;
+  for (const ValidationScene& scene : scenes) {
+    if (!selected(scene.name)) {
+      continue;
+    }
+    //several renders of each reference, their spread is the sampling noise the candidates are judged against; with
+    //five, renders of slowly mixing chains sometimes all agree unusually closely and understate it
+    const size_t num_references = 9;
+    std::map<std::string, std::vector<NebulabrotChannelCollection>> reference_sets;
+    std::map<std::string, double> reference_times;
+    for (const ValidationCandidate& candidate : candidates) {
+      //random proposals of the untuned references rarely reach a deep view, their chains mix too differently from
+      //tuned ones for the noise of their renders to judge them
+      if ((candidate.precision == PRECISION_PERTURBATION && !scene.deep) ||
+          (candidate.reference == "state_reference" && scene.deep)) {
+        continue;
+      }
+      std::vector<NebulabrotChannelCollection>& references = reference_sets[candidate.reference];
+      double& reference_time = reference_times[candidate.reference];
+      for (const ValidationCandidate& reference : reference_candidates) {
+        if (reference.name != candidate.reference || !references.empty()) {
+          continue;
+        }
+        for (size_t i = 0; i < num_references; ++i) {
+          double time;
+          references.push_back(renderScene(scene, reference, time));
+          reference_time += time / num_references;
+        }
+      }
+      size_t width = references[0].getWidth(), height = references[0].getHeight();
+      std::cerr<<"validate "<<scene.name<<" "<<candidate.name<<"\n";
+      double time;
+      NebulabrotChannelCollection result = renderScene(scene, candidate, time);
+      for (auto& channel : result.channels) {
+        std::vector<const uint32_t*> reference_data;
+        for (auto& ref : references) {
+          reference_data.push_back(ref.channels.at(channel.first).getData());
+        }
+        ChannelDifference noise = referenceNoise(reference_data, width, height);
+        ChannelDifference difference = differenceFromReferences(channel.second.getData(), reference_data, width,
+                                                                height);
+        bool passed = withinNoise(difference, noise);
+        all_passed = all_passed && passed;
+        std::ostringstream os;
+        os<<"    {\"scene\": \""<<scene.name<<"\", \"candidate\": \""<<candidate.name<<"\", \"channel\": \""
+          <<channel.first<<"\", \"passed\": "<<(passed ? "true" : "false")<<", \"time\": "<<time
+          <<", \"reference_time\": "<<reference_time<<", \"speedup\": "<<reference_time / time
+          <<",\n     \"difference\": "<<difference.toJson()<<", \"noise\": "<<noise.toJson()<<"}";
+        validations.push_back(os.str());
+      }
+    }
+  }
+  return validateReproducibility() && all_passed;
+}
+
+std::string jsonResult(const BenchResult& result) {
+  std::vector<double> sorted = result.times;
+  std::sort(sorted.begin(), sorted.end());
+  double median = sorted[sorted.size() / 2];
+  double mean = 0;
+  for (double t : sorted) {
+    mean += t;
+  }
+  mean /= sorted.size();
+  std::ostringstream os;
+  os<<"    {\"name\": \""<<result.name<<"\", \"params\": "<<result.params<<", \"runs\": "<<sorted.size()
+    <<", \"median\": "<<median<<", \"min\": "<<sorted[0]<<", \"mean\": "<<mean
+    <<", \"throughput\": "<<result.work / median<<", \"unit\": \""<<result.unit<<"/s\"";
+  if (!result.extra.empty()) {
+    os<<", "<<result.extra;
+  }
+  os<<"}";
+  return os.str();
+}
+
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--quick") {
+      options.quick = true;
+      options.min_time = 0.1;
+    } else if (arg == "--validate") {
+      options.validate = true;
+    } else if (arg == "--filter" && i + 1 < argc) {
+      options.filter = argv[++i];
+    } else if (arg == "--out" && i + 1 < argc) {
+      options.out = argv[++i];
+    } else if (arg == "--tmp" && i + 1 < argc) {
+      options.tmp = argv[++i];
+    } else {
+      std::cerr<<"usage: "<<argv[0]<<" [--quick] [--validate] [--filter substring] [--out file.json] [--tmp directory]\n";
+      return 1;
+    }
+  }
+  //the managers report progress on stdout, it is silenced so that the json can go there
+  std::ostringstream silenced;
+  std::streambuf* stdout_buf = std::cout.rdbuf(silenced.rdbuf());
+
+  bool passed = true;
+  if (options.validate) {
+    passed = runValidation();
+  } else {
+    benchOrbits();
+    benchSplat();
+    benchMerge();
+    benchImages();
+    benchPng();
+    benchRaw();
+    benchScaling();
+    benchConvergence();
+  }
+
+  std::cout.rdbuf(stdout_buf);
+  std::ostringstream os;
+  std::time_t now = std::time(nullptr);
+  char date[32];
+  std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+  os<<"{\n  \"date\": \""<<date<<"\",\n  \"hardware_threads\": "<<std::thread::hardware_concurrency()
+    <<",\n  \"numa_nodes\": "<<NumaTopology::get().getNumNodes()
+    <<",\n  \"kernels\": \""<<getCpuKernels().name<<"\",\n  \"quick\": "<<(options.quick ? "true" : "false")
+#ifdef __VERSION__
+    <<",\n  \"compiler\": \""<<__VERSION__<<"\""
+#endif
+#ifdef NDEBUG
+    <<",\n  \"assertions\": false"
+#else
+    <<",\n  \"assertions\": true"
+#endif
+    <<",\n  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    os<<jsonResult(results[i])<<(i + 1 < results.size() ? ",\n" : "\n");
+  }
+  os<<"  ]";
+  if (options.validate) {
+    os<<",\n  \"validation_passed\": "<<(passed ? "true" : "false")<<",\n  \"validation\": [\n";
+    for (size_t i = 0; i < validations.size(); ++i) {
+      os<<validations[i]<<(i + 1 < validations.size() ? ",\n" : "\n");
+    }
+    os<<"  ]";
+  }
+  os<<"\n}\n";
+  if (options.out.empty()) {
+    std::cout<<os.str();
+  } else {
+    std::ofstream fs(options.out);
+    fs<<os.str();
+    if (!fs.good()) {
+      std::cerr<<"Unable to write "<<options.out<<"\n";
+      return 1;
+    }
+  }
+  if (!passed) {
+    std::cerr<<"Validation failed\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,209 @@
+#ifndef NEBULABROTGEN_DOUBLEDOUBLE_HPP
+#define NEBULABROTGEN_DOUBLEDOUBLE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+//hides a value from the optimizer, the error-free transformations below rely on every operation being rounded
+//exactly as written, which -ffast-math (part of -Ofast) doesn't guarantee: it would simplify (a + b) - a to b
+inline double opaque(double x) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2_MATH__))
+  __asm__("" : "+x"(x));
+#elif defined(__GNUC__) && defined(__aarch64__)
+  __asm__("" : "+w"(x));
+#else
+  volatile double v = x;
+  x = v;
+#endif
+  return x;
+}
+
+//s + e == a + b exactly
+inline double twoSum(double a, double b, double& e) {
+  double s = opaque(a + b);
+  double bb = opaque(s - a);
+  e = opaque(a - opaque(s - bb)) + opaque(b - bb);
+  return s;
+}
+
+//same for |a| >= |b|
+inline double quickTwoSum(double a, double b, double& e) {
+  double s = opaque(a + b);
+  e = b - opaque(s - a);
+  return s;
+}
+
+//p + e == a * b exactly
+inline double twoProd(double a, double b, double& e) {
+  double p = opaque(a * b);
+#ifdef __FMA__
+  e = std::fma(a, b, -p);
+#else
+  //dekker's product of halves of 26 bits
+  const double split = 134217729.0;
+  double ta = opaque(split * a), tb = opaque(split * b);
+  double a_hi = opaque(ta - opaque(ta - a)), b_hi = opaque(tb - opaque(tb - b));
+  double a_lo = opaque(a - a_hi), b_lo = opaque(b - b_hi);
+  e = opaque(opaque(opaque(opaque(a_hi * b_hi - p) + a_hi * b_lo) + a_lo * b_hi) + a_lo * b_lo);
+#endif
+  return p;
+}
+
+//unevaluated sum hi + lo of two doubles, |lo| <= ulp(hi) / 2, about 106 bits of mantissa with the exponent range
+//of double; enough arithmetic for std::complex<DoubleDouble> and the renderer
+struct DoubleDouble {
+  DoubleDouble(double value = 0) : hi(value), lo(0) {}
+  DoubleDouble(double hi, double lo) : hi(hi), lo(lo) {}
+
+  explicit operator double() const {
+    return hi;
+  }
+
+  explicit operator float() const {
+    return (float) hi;
+  }
+
+  DoubleDouble operator-() const {
+    return DoubleDouble(-hi, -lo);
+  }
+
+  DoubleDouble& operator+=(const DoubleDouble& other);
+  DoubleDouble& operator-=(const DoubleDouble& other);
+  DoubleDouble& operator*=(const DoubleDouble& other);
+  DoubleDouble& operator/=(const DoubleDouble& other);
+
+  double hi, lo;
+};
+
+inline DoubleDouble operator+(const DoubleDouble& a, const DoubleDouble& b) {
+  double e;
+  double s = twoSum(a.hi, b.hi, e);
+  e += a.lo + b.lo;
+  s = quickTwoSum(s, e, e);
+  return DoubleDouble(s, e);
+}
+
+inline DoubleDouble operator-(const DoubleDouble& a, const DoubleDouble& b) {
+  return a + -b;
+}
+
+inline DoubleDouble operator*(const DoubleDouble& a, const DoubleDouble& b) {
+  double e;
+  double p = twoProd(a.hi, b.hi, e);
+  e += a.hi * b.lo + a.lo * b.hi;
+  p = quickTwoSum(p, e, e);
+  return DoubleDouble(p, e);
+}
+
+inline DoubleDouble operator*(const DoubleDouble& a, double b) {
+  double e;
+  double p = twoProd(a.hi, b, e);
+  e += a.lo * b;
+  p = quickTwoSum(p, e, e);
+  return DoubleDouble(p, e);
+}
+
+inline DoubleDouble operator/(const DoubleDouble& a, const DoubleDouble& b) {
+  //long division with three double quotients
+  double q1 = a.hi / b.hi;
+  DoubleDouble r = a - b * q1;
+  double q2 = r.hi / b.hi;
+  r = r - b * q2;
+  double q3 = r.hi / b.hi;
+  double e;
+  q1 = quickTwoSum(q1, q2, e);
+  return DoubleDouble(q1, e) + DoubleDouble(q3);
+}
+
+inline DoubleDouble& DoubleDouble::operator+=(const DoubleDouble& other) {
+  return *this = *this + other;
+}
+
+inline DoubleDouble& DoubleDouble::operator-=(const DoubleDouble& other) {
+  return *this = *this - other;
+}
+
+inline DoubleDouble& DoubleDouble::operator*=(const DoubleDouble& other) {
+  return *this = *this * other;
+}
+
+inline DoubleDouble& DoubleDouble::operator/=(const DoubleDouble& other) {
+  return *this = *this / other;
+}
+
+inline bool operator<(const DoubleDouble& a, const DoubleDouble& b) {
+  return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+inline bool operator>(const DoubleDouble& a, const DoubleDouble& b) {
+  return b < a;
+}
+
+inline bool operator<=(const DoubleDouble& a, const DoubleDouble& b) {
+  return !(b < a);
+}
+
+inline bool operator>=(const DoubleDouble& a, const DoubleDouble& b) {
+  return !(a < b);
+}
+
+inline bool operator==(const DoubleDouble& a, const DoubleDouble& b) {
+  return a.hi == b.hi && a.lo == b.lo;
+}
+
+inline bool operator!=(const DoubleDouble& a, const DoubleDouble& b) {
+  return !(a == b);
+}
+
+inline bool isfinite(const DoubleDouble& a) {
+  return std::isfinite(a.hi);
+}
+
+//decimal number with an optional exponent (e.g. -0.7436438870371587047521915 or 1.5e-20) to the full precision,
+//false if str isn't one
+inline bool parseDoubleDouble(const std::string& str, DoubleDouble& value) {
+  size_t i = 0;
+  bool negative = !str.empty() && str[0] == '-';
+  if (!str.empty() && (str[0] == '-' || str[0] == '+')) {
+    ++i;
+  }
+  DoubleDouble result;
+  int exponent = 0;
+  bool digits = false, point = false;
+  for (; i < str.size(); ++i) {
+    if (str[i] >= '0' && str[i] <= '9') {
+      result = result * 10.0 + DoubleDouble(str[i] - '0');
+      exponent -= point ? 1 : 0;
+      digits = true;
+    } else if (str[i] == '.' && !point) {
+      point = true;
+    } else {
+      break;
+    }
+  }
+  if (i < str.size() && (str[i] == 'e' || str[i] == 'E')) {
+    size_t end = 0;
+    try {
+      exponent += std::stoi(str.substr(i + 1), &end);
+    } catch (const std::exception&) {
+      return false;
+    }
+    i += 1 + end;
+  }
+  if (!digits || i != str.size()) {
+    return false;
+  }
+  //beyond the range of double either way
+  exponent = std::max(-700, std::min(700, exponent));
+  DoubleDouble power(1.0);
+  for (int k = 0; k < std::abs(exponent); ++k) {
+    power = power * 10.0;
+  }
+  result = exponent < 0 ? result / power : result * power;
+  value = negative ? -result : result;
+  return true;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#include "kernels.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+namespace kernels_generic {
+extern const CpuKernels kernels;
+}
+
+//defined by cmake when kernels.cpp is also compiled for the x86 extensions
+#ifdef NEBULABROTGEN_DISPATCH
+namespace kernels_avx2 {
+extern const CpuKernels kernels;
+}
+namespace kernels_avx512 {
+extern const CpuKernels kernels;
+}
+#endif
+
+namespace {
+
+std::atomic<const CpuKernels*> selected_kernels(nullptr);
+std::atomic<uint64_t> seed_counter(0);
+
+const CpuKernels* detectKernels() {
+  std::vector<const CpuKernels*> supported = getSupportedCpuKernels();
+  const char* forced = std::getenv("NEBULABROTGEN_KERNELS");
+  if (forced && *forced) {
+    for (const CpuKernels* kernels : supported) {
+      if (kernels->name == std::string(forced)) {
+        return kernels;
+      }
+    }
+    std::cout<<"Kernels "<<forced<<" aren't available, using "<<supported.back()->name<<"\n";
+  }
+  return supported.back();
+}
+
+}
+
+//thread ids repeat with pooled threads, the counter keeps seeds of consecutive renderers distinct
+uint64_t nextRendererSeed() {
+  std::hash<std::thread::id> hasher;
+  return hasher(std::this_thread::get_id()) ^ (seed_counter++ * 0x9e3779b97f4a7c15ull);
+}
+
+std::vector<const CpuKernels*> getSupportedCpuKernels() {
+  std::vector<const CpuKernels*> result = {&kernels_generic::kernels};
+#ifdef NEBULABROTGEN_DISPATCH
+  //checks cpuid and whether the os saves the extended registers
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("bmi2");
+  if (avx2) {
+    result.push_back(&kernels_avx2::kernels);
+  }
+  if (avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+      __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl")) {
+    result.push_back(&kernels_avx512::kernels);
+  }
+#endif
+  return result;
+}
+
+const CpuKernels& getCpuKernels() {
+  const CpuKernels* kernels = selected_kernels.load(std::memory_order_acquire);
+  if (!kernels) {
+    //concurrent first calls detect the same set
+    kernels = detectKernels();
+    selected_kernels.store(kernels, std::memory_order_release);
+  }
+  return *kernels;
+}
+
+bool setCpuKernels(const std::string& name) {
+  for (const CpuKernels* kernels : getSupportedCpuKernels()) {
+    if (kernels->name == name) {
+      selected_kernels.store(kernels, std::memory_order_release);
+      return true;
+    }
+  }
+  std::cout<<"Kernels "<<name<<" aren't available on this cpu\n";
+  return false;
+}
@@ -0,0 +1,182 @@
+//compiled once per instruction set by cmake (NEBULABROTGEN_KERNELS_AVX2, NEBULABROTGEN_KERNELS_AVX512),
+//or once without definitions as the generic set
+//standard headers are included before the target pragma, so that library code instantiated here is compiled for
+//the baseline and can't replace the baseline copies of other translation units at link time
+#include "kernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if defined(NEBULABROTGEN_KERNELS_AVX512)
+#define NEBULABROTGEN_KERNELS kernels_avx512
+#define NEBULABROTGEN_KERNELS_NAME "avx512"
+#pragma GCC target("avx512f,avx512bw,avx512dq,avx512vl,avx2,fma,bmi,bmi2,popcnt")
+#elif defined(NEBULABROTGEN_KERNELS_AVX2)
+#define NEBULABROTGEN_KERNELS kernels_avx2
+#define NEBULABROTGEN_KERNELS_NAME "avx2"
+#pragma GCC target("avx2,fma,bmi,bmi2,popcnt")
+#else
+#define NEBULABROTGEN_KERNELS kernels_generic
+#define NEBULABROTGEN_KERNELS_NAME "generic"
+#endif
+
+#include "stdcomplexrenderer.hpp"
+#include "perturbationrenderer.hpp"
+
+namespace NEBULABROTGEN_KERNELS {
+
+namespace {
+
+//renderer_t: BuddhabrotRenderer or PerturbationRenderer, constructed from the arguments
+template<typename renderer_t>
+class DispatchedRenderer : public OrbitRenderer {
+public:
+  typedef typename renderer_t::real_type real_t;
+
+  template<typename... Args>
+  explicit DispatchedRenderer(Args... args)
+      : renderer(args...) {}
+
+  void setArea(const DoubleDouble& xmid, const DoubleDouble& ymid, double factor) override {
+    renderer.setArea((real_t) xmid, (real_t) ymid, (real_t) factor);
+  }
+
+  void setSplatEstimator(SplatEstimator estimator) override {
+    renderer.setSplatEstimator(estimator);
+  }
+
+  void setMutation(const MutationParameters& mutation) override {
+    renderer.setMutation(mutation);
+  }
+
+  const MutationParameters& getMutation() const override {
+    return renderer.getMutation();
+  }
+
+  void tuneMutation() override {
+    renderer.tuneMutation();
+  }
+
+  void prepareInitialPoints() override {
+    renderer.prepareInitialPoints();
+  }
+
+  void outputPointValues(uint32_t* out, size_t iterations) override {
+    renderer.outputPointValues(out, iterations);
+  }
+
+  void outputSeededPointValues(uint32_t* out, size_t iterations, uint64_t key) override {
+    renderer.outputSeededPointValues(out, iterations, key);
+  }
+
+  size_t orbitIterations(std::complex<double> c) override {
+    return renderer.orbitIterations(std::complex<real_t>((real_t) c.real(), (real_t) c.imag()));
+  }
+
+  const RendererStats& getStats() const override {
+    return renderer.getStats();
+  }
+
+  void resetStats() override {
+    renderer.resetStats();
+  }
+
+private:
+  renderer_t renderer;
+};
+
+template<typename real_t>
+OrbitRenderer* createRenderer(size_t width, size_t height, size_t max_iter, size_t init_points,
+                              void(*func)(std::complex<real_t>&, std::complex<real_t>),
+                              double random_radius, double norm_limit, RandomGenerator generator) {
+  if (!func) {
+    return nullptr;
+  }
+  if (generator == RANDOM_MT19937) {
+    return new DispatchedRenderer<BuddhabrotRenderer<real_t, Mt19937Generator>>(
+        width, height, max_iter, init_points, func, random_radius, (real_t) norm_limit);
+  }
+  if (generator == RANDOM_PHILOX) {
+    return new DispatchedRenderer<BuddhabrotRenderer<real_t, PhiloxGenerator>>(
+        width, height, max_iter, init_points, func, random_radius, (real_t) norm_limit);
+  }
+  return new DispatchedRenderer<BuddhabrotRenderer<real_t, XoshiroGenerator>>(
+      width, height, max_iter, init_points, func, random_radius, (real_t) norm_limit);
+}
+
+OrbitRenderer* createPerturbationRenderer(size_t width, size_t height, size_t max_iter, size_t init_points,
+                                          const InnerFunctionData& func, double norm_limit, RandomGenerator generator) {
+  if (!func.double_double_ptr || !func.perturbation_ptr) {
+    return nullptr;
+  }
+  if (generator == RANDOM_MT19937) {
+    return new DispatchedRenderer<PerturbationRenderer<Mt19937Generator>>(
+        width, height, max_iter, init_points, func.double_double_ptr, func.perturbation_ptr, norm_limit);
+  }
+  if (generator == RANDOM_PHILOX) {
+    return new DispatchedRenderer<PerturbationRenderer<PhiloxGenerator>>(
+        width, height, max_iter, init_points, func.double_double_ptr, func.perturbation_ptr, norm_limit);
+  }
+  return new DispatchedRenderer<PerturbationRenderer<XoshiroGenerator>>(
+      width, height, max_iter, init_points, func.double_double_ptr, func.perturbation_ptr, norm_limit);
+}
+
+OrbitRenderer* createRenderer(size_t width, size_t height, size_t max_iter, size_t init_points,
+                              const InnerFunctionData& func, double random_radius, double norm_limit,
+                              RandomGenerator generator, RendererPrecision precision) {
+  if (precision == PRECISION_FLOAT) {
+    return createRenderer(width, height, max_iter, init_points, func.float_ptr, random_radius, norm_limit, generator);
+  }
+  if (precision == PRECISION_PERTURBATION) {
+    return createPerturbationRenderer(width, height, max_iter, init_points, func, norm_limit, generator);
+  }
+  if (precision == PRECISION_DOUBLE_DOUBLE) {
+    return createRenderer(width, height, max_iter, init_points, func.double_double_ptr, random_radius, norm_limit,
+                          generator);
+  }
+  return createRenderer(width, height, max_iter, init_points, func.ptr, random_radius, norm_limit, generator);
+}
+
+void mergeCounts(uint32_t* dst, const uint32_t* src, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    dst[i] += src[i];
+  }
+}
+
+uint32_t maxCount(const uint32_t* data, size_t count) {
+  uint32_t result = 0;
+  for (size_t i = 0; i < count; ++i) {
+    result = data[i] > result ? data[i] : result;
+  }
+  return result;
+}
+
+void scaleCounts(const uint32_t* input, size_t count, double scale, double* output) {
+  for (size_t i = 0; i < count; ++i) {
+    output[i] = scale * input[i];
+  }
+}
+
+void lookupCounts(const uint32_t* input, size_t count, const double* table, uint32_t max_value, uint32_t shift,
+                  double* output) {
+  uint64_t round = ((uint64_t) 1 << shift) >> 1;
+  for (size_t i = 0; i < count; ++i) {
+    output[i] = table[((input[i] < max_value ? input[i] : max_value) + round) >> shift];
+  }
+}
+
+}
+
+extern const CpuKernels kernels = {NEBULABROTGEN_KERNELS_NAME, createRenderer, mergeCounts, maxCount, scaleCounts,
+                                   lookupCounts};
+
+}
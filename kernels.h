@@ -0,0 +1,182 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <complex>
+#include <string>
+#include <vector>
+#include "doubledouble.hpp"
+
+typedef void(*InnerFunc)(std::complex<double>&, std::complex<double>);
+typedef void(*InnerFuncFloat)(std::complex<float>&, std::complex<float>);
+typedef void(*InnerFuncDoubleDouble)(std::complex<DoubleDouble>&, std::complex<DoubleDouble>);
+//perturbation form of an inner function for deep zooms: with ref the point of a reference orbit before the step and
+//dz, dc the offsets of another orbit from it and its c, replaces dz by the offset after the step,
+//e.g. dz = (2.0 * ref + dz) * dz + dc for z * z + c
+typedef void(*InnerFuncPerturbation)(std::complex<double>& dz, std::complex<double> ref, std::complex<double> dc);
+
+//the inner function of a channel, variants in other precisions are optional (nullptr) and let the renderer
+//use them when the view allows (float) or requires (double-double, perturbation with both) it, see selectPrecision
+struct InnerFunctionData {
+  InnerFunctionData(InnerFunc ptr, double cost = 1.0);
+  InnerFunctionData(InnerFunc ptr, InnerFuncFloat float_ptr, InnerFuncDoubleDouble double_double_ptr, double cost = 1.0);
+  InnerFunctionData(InnerFunc ptr, InnerFuncFloat float_ptr, InnerFuncDoubleDouble double_double_ptr,
+                    InnerFuncPerturbation perturbation_ptr, double cost = 1.0);
+  InnerFunc ptr;
+  InnerFuncFloat float_ptr;
+  InnerFuncDoubleDouble double_double_ptr;
+  InnerFuncPerturbation perturbation_ptr;
+  double cost;
+};
+
+//counts of metropolis-hastings proposals since the last reset
+struct RendererStats {
+  uint64_t proposals = 0;
+  uint64_t accepted = 0;
+  uint64_t rejected_non_escaping = 0;
+  uint64_t rejected_off_screen = 0;
+  //proposals of the perturbation renderer computed in double-double after all
+  uint64_t glitches = 0;
+  //orbits iterated again to splat them: accepted ones evaluated without storing their points, states of adaptive chains
+  uint64_t recomputed = 0;
+};
+
+//source of the sampler's uniforms, see rng.hpp
+enum RandomGenerator {
+  RANDOM_XOSHIRO = 0, RANDOM_MT19937 = 1, RANDOM_PHILOX = 2
+};
+
+//real type of the orbits, auto lets the rendering manager choose per channel
+//perturbation: double offsets from double-double reference orbits, see perturbationrenderer.hpp
+enum RendererPrecision {
+  PRECISION_AUTO = 0, PRECISION_FLOAT = 1, PRECISION_DOUBLE = 2, PRECISION_DOUBLE_DOUBLE = 3, PRECISION_PERTURBATION = 4
+};
+
+//proposals of the metropolis-hastings chains: a random point with probability random_fraction, otherwise a move of
+//the chain's point by a radius between move_min and move_max times the view's factor, log-uniformly
+//adaptive: a burn-in of burn_in proposals per chain first scales both radii towards target_acceptance of the moves,
+//then sets random_fraction to the acceptance rate of random proposals relative to the sum of both rates
+//the splatted proposals (see SplatEstimator) are distributed as the sampled density times their acceptance rate,
+//which depends on the proposals: with fixed parameters, random_fraction and the move radii change the image, not only
+//how fast it converges; adaptive chains instead count the state they are in after every proposal, the sampled density
+//alone, so tuning leaves the image as it is (burn_in 0 keeps the configured proposals)
+struct MutationParameters {
+  double random_fraction = 0.8;
+  double move_min = 0.0001;
+  double move_max = 0.1;
+  //chains of a renderer (one per thread), deterministic renders run one chain per job
+  size_t chains = 16;
+  bool adaptive = false;
+  double target_acceptance = 0.234;
+  size_t burn_in = 1000;
+};
+
+//limits of tuned parameters: random proposals rarely reach small views, but without them chains mix between distant
+//regions of wide views too slowly; moves beyond the view's size are random proposals in all but name
+const double MUTATION_MIN_RANDOM_FRACTION = 0.2;
+const double MUTATION_MAX_RANDOM_FRACTION = 0.95;
+const double MUTATION_MAX_MOVE = 1;
+
+//robbins-monro step of the logarithm of the move radii after move number k of a burn-in
+inline void adaptMoveRadius(MutationParameters& mutation, bool accepted, size_t k) {
+  double scale = std::exp(((accepted ? 1.0 : 0.0) - mutation.target_acceptance) / std::sqrt(k + 1.0));
+  scale = std::min(scale, MUTATION_MAX_MOVE / mutation.move_max);
+  mutation.move_min *= scale;
+  mutation.move_max *= scale;
+}
+
+//random_fraction from the acceptance rates of both kinds of proposals in a burn-in
+inline void adaptRandomFraction(MutationParameters& mutation, double random_acceptance, double move_acceptance) {
+  if (random_acceptance + move_acceptance > 0) {
+    mutation.random_fraction = std::max(MUTATION_MIN_RANDOM_FRACTION,
+                                        std::min(MUTATION_MAX_RANDOM_FRACTION,
+                                                 random_acceptance / (random_acceptance + move_acceptance)));
+  }
+}
+
+//metropolis-hastings acceptance probability of a proposal with contribution curr_contrib (on-screen points per
+//iteration) and curr_on_screen points from a state with prev_contrib and prev_on_screen, shared by all renderers so
+//that they sample the same density, contribution times the square of the on-screen points; the transition terms
+//depend on the states alone, not on the proposal, so they don't cancel for symmetric moves
+inline double transitionProbability(size_t n1, size_t n2, size_t max_iter) {
+  return (1.0 - ((double) (max_iter - n1)) / max_iter) /
+         (1.0 - ((double) (max_iter - n2)) / max_iter);
+}
+
+inline double acceptanceProbability(double curr_contrib, size_t curr_on_screen, double prev_contrib,
+                                    size_t prev_on_screen, size_t max_iter) {
+  double t1 = transitionProbability(curr_on_screen, prev_on_screen, max_iter);
+  double t2 = transitionProbability(prev_on_screen, curr_on_screen, max_iter);
+  //both contributions are positive, accepted orbits and initial points are on screen
+  return std::min(1.0, (curr_contrib * t1) / (prev_contrib * t2));
+}
+
+//what a proposal adds to the counts: accepted ones their orbit once, or (expected) every proposal its orbit weighted
+//by the acceptance probability in units of 1 / SPLAT_WEIGHT_SCALE, the expectation of the former over the
+//acceptance test (rao-blackwellized), with less noise per orbit and counts SPLAT_WEIGHT_SCALE times larger;
+//adaptive chains add their states the same way, see MutationParameters
+enum SplatEstimator {
+  SPLAT_ACCEPTED = 0, SPLAT_EXPECTED = 1
+};
+const uint32_t SPLAT_WEIGHT_SCALE = 16;
+
+//renderer of one channel as used by the rendering manager, implemented by BuddhabrotRenderer and
+//PerturbationRenderer compiled for each instruction set in kernels.cpp
+class OrbitRenderer {
+public:
+  virtual ~OrbitRenderer() {}
+  //the centre in double-double for deep zooms, renderers of lower precisions round it
+  virtual void setArea(const DoubleDouble& xmid, const DoubleDouble& ymid, double factor) = 0;
+  //accepted by default
+  virtual void setSplatEstimator(SplatEstimator estimator) = 0;
+  //chains are given when the renderer is created, the perturbation renderer only moves
+  virtual void setMutation(const MutationParameters& mutation) = 0;
+  //parameters after tuning
+  virtual const MutationParameters& getMutation() const = 0;
+  //burn-in of adaptive parameters on the initial points, without output; deterministic renders tune every chain
+  //in outputSeededPointValues instead
+  virtual void tuneMutation() = 0;
+  virtual void prepareInitialPoints() = 0;
+  //adds the orbits of iterations proposals per initial point to counts in out
+  virtual void outputPointValues(uint32_t* out, size_t iterations) = 0;
+  //same without depending on earlier calls, chains are seeded from key and find their own initial points
+  virtual void outputSeededPointValues(uint32_t* out, size_t iterations, uint64_t key) = 0;
+  //computes a single orbit of c, returns the number of iterations done
+  virtual size_t orbitIterations(std::complex<double> c) = 0;
+  virtual const RendererStats& getStats() const = 0;
+  virtual void resetStats() = 0;
+};
+
+//hot loops compiled for several instruction sets, the best one the cpu supports is selected on first use
+//builds without cmake (or with NEBULABROTGEN_NATIVE) only have the generic set compiled with the global flags
+struct CpuKernels {
+  //generic, avx2 or avx512
+  const char* name;
+  //nullptr if func has no variant in the precision (auto means double, perturbation needs double-double as well)
+  OrbitRenderer* (*createRenderer)(size_t width, size_t height, size_t max_iter, size_t init_points,
+                                   const InnerFunctionData& func, double random_radius, double norm_limit,
+                                   RandomGenerator generator, RendererPrecision precision);
+  //dst[i] += src[i]
+  void (*mergeCounts)(uint32_t* dst, const uint32_t* src, size_t count);
+  uint32_t (*maxCount)(const uint32_t* data, size_t count);
+  //output[i] = scale * input[i]
+  void (*scaleCounts)(const uint32_t* input, size_t count, double scale, double* output);
+  //output[i] = table[round(min(input[i], max_value) / 2^shift)]
+  void (*lookupCounts)(const uint32_t* input, size_t count, const double* table, uint32_t max_value, uint32_t shift,
+                       double* output);
+};
+
+//distinct seed for every renderer created by any kernel set
+uint64_t nextRendererSeed();
+
+//selected kernels, the environment variable NEBULABROTGEN_KERNELS can force a lower level (e.g. generic)
+const CpuKernels& getCpuKernels();
+//kernel sets compiled in and supported by the cpu, from the lowest level
+std::vector<const CpuKernels*> getSupportedCpuKernels();
+//false if the set isn't compiled in or the cpu doesn't support it
+bool setCpuKernels(const std::string& name);
+
+#endif
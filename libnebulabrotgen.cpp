@@ -1,14 +1,72 @@
 #include "libnebulabrotgen.h"
-#include "stdcomplexrenderer.hpp"
+#include "trace.h"
 
 #include <algorithm>
+#include <atomic>
+#include <tuple>
 #include <thread>
+#include <sstream>
+#include <cstdio>
+#include <limits>
+#ifdef __unix__
+#include <sys/resource.h>
+#endif
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-//#define RENDERING_DEBUG
-//#define IMAGE_DEBUG
+static double secondsSince(std::chrono::time_point<std::chrono::high_resolution_clock> time) {
+  return std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - time).count();
+}
+
+static std::string jsonString(const std::string& str) {
+  std::string result = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if ((unsigned char) c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      result += buf;
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+//parameters of the channel's proposals, the means of the tuned ones for adaptive channels
+static std::string mutationJson(const RenderChannelMetrics& ch) {
+  std::ostringstream os;
+  const MutationParameters& m = ch.mutation;
+  double n = (double) ch.tunings;
+  os<<"{\"adaptive\": "<<(m.adaptive ? "true" : "false")<<", \"chains\": "<<m.chains
+    <<", \"random_fraction\": "<<(ch.tunings ? ch.tuned_random_fraction / n : m.random_fraction)
+    <<", \"move_min\": "<<(ch.tunings ? ch.tuned_move_min / n : m.move_min)
+    <<", \"move_max\": "<<(ch.tunings ? ch.tuned_move_max / n : m.move_max)<<"}";
+  return os.str();
+}
+
+//peak resident memory of the whole process, 0 if unknown
+static size_t peakMemoryBytes() {
+#ifdef __unix__
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    return (size_t) usage.ru_maxrss * 1024;
+  }
+#endif
+  return 0;
+}
+
+//key of a deterministic job, channels are identified by name (fnv-1a) so keys don't depend on other channels
+static uint64_t jobKey(uint64_t seed, const std::string& channel, size_t job) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (char c : channel) {
+    hash = (hash ^ (unsigned char) c) * 0x100000001b3ull;
+  }
+  return seed ^ (hash * 0x9e3779b97f4a7c15ull) ^ ((uint64_t) job * 0xbf58476d1ce4e5b9ull);
+}
 
 inline bool file_exists(const std::string& name) {
   if (FILE *file = fopen((name + ".png").c_str(), "r")) {
@@ -25,17 +83,23 @@ void logMessage(const std::string& message) {
 
 
 NebulabrotChannelBuffer::NebulabrotChannelBuffer(size_t width, size_t height)
-    : completed_iterations(0), data(width*height), max_value(0), mergeMutex(new std::mutex()) {}
+    : completed_iterations(0), weight_scale(1), data(width*height), max_value(0), mergeMutex(new std::mutex()) {}
 
 NebulabrotChannelBuffer::NebulabrotChannelBuffer(const NebulabrotChannelBuffer& other) {
   completed_iterations = other.completed_iterations;
+  weight_scale = other.weight_scale;
   data = other.data;
   max_value = other.max_value;
   mergeMutex = std::unique_ptr<std::mutex>(new std::mutex());
 }
 
+NebulabrotChannelBuffer::NebulabrotChannelBuffer(NebulabrotChannelBuffer&& other) noexcept
+    : completed_iterations(other.completed_iterations), weight_scale(other.weight_scale), data(std::move(other.data)),
+      max_value(other.max_value), mergeMutex(std::move(other.mergeMutex)) {}
+
 NebulabrotChannelBuffer& NebulabrotChannelBuffer::operator=(const NebulabrotChannelBuffer& other) {
   completed_iterations = other.completed_iterations;
+  weight_scale = other.weight_scale;
   data = other.data;
   max_value = other.max_value;
   mergeMutex = std::unique_ptr<std::mutex>(new std::mutex());
@@ -44,6 +108,7 @@ NebulabrotChannelBuffer& NebulabrotChannelBuffer::operator=(const NebulabrotChan
 
 void NebulabrotChannelBuffer::clear() {
   std::fill(data.begin(), data.end(), 0);
+  completed_iterations = 0;
 }
 
 uint32_t* NebulabrotChannelBuffer::getData() {
@@ -61,55 +126,131 @@ bool NebulabrotChannelBuffer::mergeWith(const NebulabrotChannelBuffer& other) {
   if (mem_size != other.data.size()) {
     return false;
   }
-  for (size_t i = 0; i < mem_size; ++i) {
-    data[i] += other.data[i];
+  //an empty buffer takes the scale of the first counts merged into it
+  if (completed_iterations == 0) {
+    weight_scale = other.weight_scale;
+  } else if (other.completed_iterations > 0 && weight_scale != other.weight_scale) {
+    return false;
   }
+  getCpuKernels().mergeCounts(data.data(), other.data.data(), mem_size);
   completed_iterations += other.completed_iterations;
   return true;
 }
 
+size_t NebulabrotChannelBuffer::getSize() const {
+  return data.size();
+}
+
 bool NebulabrotChannelBuffer::toStream(std::ostream& os) {
-  os.write((char*) &completed_iterations, sizeof(size_t));
-  os.write((char*) &max_value, sizeof(size_t));
+  headerToStream(os);
   os.write((char*) data.data(), data.size() * sizeof(uint32_t));
   return os.good();
 }
 
 bool NebulabrotChannelBuffer::fromStream(std::istream& is) {
-  is.read((char*) &completed_iterations, sizeof(size_t));
-  is.read((char*) &max_value, sizeof(size_t));
+  headerFromStream(is);
   is.read((char*) data.data(), data.size() * sizeof(uint32_t));
   return is.good();
 }
 
-void NebulabrotChannelBuffer::updateMaxValue() {
-  std::lock_guard<std::mutex> lock(*mergeMutex);
-#ifdef RENDERING_DEBUG
-  auto time_begin = std::chrono::high_resolution_clock::now();
-#endif
-  max_value = 0;
-  size_t mem_size = data.size();
-  for (size_t i = 0; i < mem_size; ++i) {
-    if (data[i] > max_value) {
-      max_value = data[i];
-    }
+//max value occupies 8 bytes in the file, older versions left garbage in the upper half
+bool NebulabrotChannelBuffer::headerToStream(std::ostream& os) {
+  uint64_t max_value_field = max_value;
+  uint64_t weight_scale_field = weight_scale;
+  os.write((char*) &completed_iterations, sizeof(size_t));
+  os.write((char*) &max_value_field, sizeof(uint64_t));
+  os.write((char*) &weight_scale_field, sizeof(uint64_t));
+  return os.good();
+}
+
+bool NebulabrotChannelBuffer::headerFromStream(std::istream& is, bool weight_scale) {
+  uint64_t max_value_field = 0;
+  uint64_t weight_scale_field = 1;
+  is.read((char*) &completed_iterations, sizeof(size_t));
+  is.read((char*) &max_value_field, sizeof(uint64_t));
+  if (weight_scale) {
+    is.read((char*) &weight_scale_field, sizeof(uint64_t));
   }
+  max_value = static_cast<uint32_t>(max_value_field);
+  this->weight_scale = static_cast<uint32_t>(std::max((uint64_t) 1, weight_scale_field));
+  return is.good();
+}
 
-#ifdef RENDERING_DEBUG
-  double time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - time_begin).count();
-  std::cout<<"Updated max value in " + std::to_string(time) + "s\n";
-#endif
+void NebulabrotChannelBuffer::updateMaxValue() {
+  TraceScope trace("update max value", "render");
+  std::lock_guard<std::mutex> lock(*mergeMutex);
+  max_value = getCpuKernels().maxCount(data.data(), data.size());
 }
 
 NebulabrotChannelCollection::NebulabrotChannelCollection(size_t width, size_t height)
     : width(width), height(height) {}
 
-bool NebulabrotChannelCollection::loadFile(const std::string& filename) {
+const size_t FILE_CHUNK_SIZE = 8 << 20;
+//set in the width field of files whose channel headers record the weight scale
+const size_t RAW_FILE_WEIGHT_SCALES = (size_t) 1 << 63;
+
+struct FileChunk {
+  FileChunk(size_t offset, char* data, size_t size) : offset(offset), data(data), size(size) {}
+  size_t offset;
+  char* data;
+  size_t size;
+};
+
+static void appendFileChunks(std::vector<FileChunk>& chunks, size_t offset, char* data, size_t size) {
+  for (size_t pos = 0; pos < size; pos += FILE_CHUNK_SIZE) {
+    chunks.emplace_back(offset + pos, data + pos, std::min(FILE_CHUNK_SIZE, size - pos));
+  }
+}
+
+//each thread opens its own stream and transfers chunks at their offsets, the file must already exist
+static bool transferFileChunks(const std::string& filename, const std::vector<FileChunk>& chunks,
+                               bool write, size_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  num_threads = std::min(num_threads, chunks.size());
+  std::atomic<size_t> next_chunk(0);
+  std::atomic<bool> success(true);
+  auto thread_function = [&]() {
+    auto mode = write ? std::ios::in | std::ios::out | std::ios::binary : std::ios::in | std::ios::binary;
+    std::fstream fs(filename, mode);
+    if (!fs.is_open()) {
+      success = false;
+      return;
+    }
+    while (success) {
+      size_t i = next_chunk++;
+      if (i >= chunks.size()) {
+        break;
+      }
+      TraceScope trace(write ? "write chunk" : "read chunk", "io", "bytes", chunks[i].size);
+      if (write) {
+        fs.seekp(chunks[i].offset);
+        fs.write(chunks[i].data, chunks[i].size);
+      } else {
+        fs.seekg(chunks[i].offset);
+        fs.read(chunks[i].data, chunks[i].size);
+      }
+      if (!fs.good()) {
+        success = false;
+      }
+    }
+    fs.close();
+  };
+  ThreadPool::shared().run(num_threads, [&](size_t) { thread_function(); });
+  return success;
+}
+
+bool NebulabrotChannelCollection::loadFile(const std::string& filename, size_t num_threads) {
+  TraceScope trace("load file", "io");
   auto fs = std::fstream(filename, std::ios::in | std::ios::binary);
   if (!fs.is_open()) {
     std::cout<<"Unable to open raw results file: "<<filename<<"\n";
     return false;
   }
+  fs.seekg(0, std::ios::end);
+  size_t file_size = fs.tellg();
+  fs.seekg(0, std::ios::beg);
   size_t read_width;
   size_t read_height;
   fs.read((char*) &read_width, sizeof(read_width));
@@ -119,11 +260,17 @@ bool NebulabrotChannelCollection::loadFile(const std::string& filename) {
     fs.close();
     return false;
   }
+  bool weight_scales = (read_width & RAW_FILE_WEIGHT_SCALES) != 0;
+  read_width &= ~RAW_FILE_WEIGHT_SCALES;
   if (width != read_width || height != read_height) {
     std::cout<<"Error while loading: "<<filename<<", resolution mismatch\n";
     fs.close();
+    return false;
   }
-  std::string channels_info;
+  std::vector<std::string> names;
+  std::vector<NebulabrotChannelBuffer> buffers;
+  std::vector<size_t> data_offsets;
+  size_t data_size = width * height * sizeof(uint32_t);
   while (true) {
     NebulabrotChannelBuffer buf(width, height);
     size_t read_name_length = 0;
@@ -145,61 +292,159 @@ bool NebulabrotChannelCollection::loadFile(const std::string& filename) {
         return false;
       }
     }
-    if (!buf.fromStream(fs)) {
-      if (fs.eof()) {
-        std::cout<<"Error while loading "<<name<<" from "<<filename<<", EoF reached\n";
-      } else {
-        std::cout<<"Error while loading "<<name<<" from "<<filename<<"\n";
-      }
+    bool header_read = buf.headerFromStream(fs, weight_scales);
+    size_t data_offset = fs.tellg();
+    if (!header_read || data_offset + data_size > file_size) {
+      std::cout<<"Error while loading "<<name<<" from "<<filename<<", EoF reached\n";
+      break;
     }
+    fs.seekg(data_offset + data_size);
+    names.push_back(name);
+    buffers.push_back(std::move(buf));
+    data_offsets.push_back(data_offset);
+  }
+  fs.close();
+
+  //buffers vector is complete, so data pointers are stable from now on
+  std::vector<FileChunk> chunks;
+  for (size_t i = 0; i < data_offsets.size(); ++i) {
+    appendFileChunks(chunks, data_offsets[i], (char*) buffers[i].getData(), data_size);
+  }
+  if (!transferFileChunks(filename, chunks, false, num_threads)) {
+    std::cout<<"Error while loading: "<<filename<<"\n";
+    return false;
+  }
+
+  std::string channels_info;
+  for (size_t i = 0; i < names.size(); ++i) {
     if (!channels_info.empty()) {
       channels_info += ", ";
     }
-    auto it = channels.find(name);
+    auto it = channels.find(names[i]);
     if (it == channels.end()) {
-      channels.emplace(name, std::move(buf));
-      channels_info += name;
+      channels.emplace(names[i], std::move(buffers[i]));
+      channels_info += names[i];
     } else {
-      if (!it->second.mergeWith(buf)) {
-        std::cout<<"Error while loading and merging "<<name<<" from "<<filename<<": this should never happen\n";
+      if (!it->second.mergeWith(buffers[i])) {
+        std::cout<<"Error while loading and merging "<<names[i]<<" from "<<filename
+                 <<": rendered with another estimator, not merged\n";
+        channels_info += names[i] + "(not merged)";
+        continue;
       }
       it->second.updateMaxValue();
-      channels_info += name + "(merged)";
+      channels_info += names[i] + "(merged)";
     }
   }
-  fs.close();
   std::cout<<"Loaded raw results file: "<<filename<<", channels: "<<channels_info<<"\n";
   return true;
 }
 
-bool NebulabrotChannelCollection::saveFile(const std::string& filename) {
+bool NebulabrotChannelCollection::saveFile(const std::string& filename, size_t num_threads) {
+  TraceScope trace("save file", "io");
   auto fs = std::fstream(filename, std::ios::out | std::ios::binary | std::ios::trunc);
   if (!fs.is_open()) {
     std::cout<<"Unable to create raw results file: "<<filename<<"\n";
     return false;
   }
-  fs.write((char*) &width, sizeof(width));
+  size_t width_field = width | RAW_FILE_WEIGHT_SCALES;
+  fs.write((char*) &width_field, sizeof(width_field));
   fs.write((char*) &height, sizeof(height));
+  std::vector<FileChunk> chunks;
   std::string channels_info;
   for (auto& p : channels) {
     size_t string_len = p.first.size();
     fs.write((char*) &string_len, sizeof(string_len));
     fs.write(&p.first[0], string_len);
-    if (!p.second.toStream(fs)) {
+    p.second.headerToStream(fs);
+    if (!fs.good()) {
       std::cout<<"Error while saving raw results file: "<<filename<<"\n";
       fs.close();
       return false;
     }
+    size_t data_size = p.second.getSize() * sizeof(uint32_t);
+    size_t data_offset = fs.tellp();
+    appendFileChunks(chunks, data_offset, (char*) p.second.getData(), data_size);
+    fs.seekp(data_offset + data_size);
     if (!channels_info.empty()) {
       channels_info += ", ";
     }
     channels_info += p.first;
   }
   fs.close();
+  if (!transferFileChunks(filename, chunks, true, num_threads)) {
+    std::cout<<"Error while saving raw results file: "<<filename<<"\n";
+    return false;
+  }
   std::cout<<"Saved raw results file: "<<filename<<", channels: "<<channels_info<<"\n";
   return true;
 }
 
+static std::string npyHeader(const std::string& descr, size_t width, size_t height) {
+  std::string dict = "{'descr': '" + descr + "', 'fortran_order': False, 'shape': ("
+                     + std::to_string(height) + ", " + std::to_string(width) + "), }";
+  //magic, version and header length take 10 bytes, data has to start at multiple of 64
+  size_t header_len = (10 + dict.size() + 1 + 63) / 64 * 64 - 10;
+  dict.resize(header_len - 1, ' ');
+  dict += '\n';
+  std::string header("\x93NUMPY\x01\x00", 8);
+  header += (char) (header_len & 0xff);
+  header += (char) (header_len >> 8);
+  return header + dict;
+}
+
+bool NebulabrotChannelCollection::exportNpy(const std::string& prefix, bool normalized, size_t num_threads) {
+  TraceScope trace("export npy", "io");
+  const uint16_t endian_test = 1;
+  std::string byte_order = *((const uint8_t*) &endian_test) ? "<" : ">";
+  std::string channels_info;
+  std::vector<float> normalized_data;
+  for (auto& p : channels) {
+    std::string filename = prefix + "_" + p.first + ".npy";
+    std::string header = npyHeader(byte_order + (normalized ? "f4" : "u4"), width, height);
+    auto fs = std::fstream(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!fs.is_open()) {
+      std::cout<<"Unable to create npy file: "<<filename<<"\n";
+      return false;
+    }
+    fs.write(header.data(), header.size());
+    fs.close();
+    if (!fs.good()) {
+      std::cout<<"Error while writing npy file: "<<filename<<"\n";
+      return false;
+    }
+
+    size_t size = p.second.getSize();
+    char* data = (char*) p.second.getData();
+    if (normalized) {
+      uint32_t max_value = p.second.getMaxValue();
+      if (max_value == 0) {
+        p.second.updateMaxValue();
+        max_value = p.second.getMaxValue();
+      }
+      float scale = max_value > 0 ? 1.0f / max_value : 0.0f;
+      const uint32_t* input = p.second.getData();
+      normalized_data.resize(size);
+      float* output = normalized_data.data();
+      for (size_t i = 0; i < size; ++i) {
+        output[i] = input[i] * scale;
+      }
+      data = (char*) output;
+    }
+    std::vector<FileChunk> chunks;
+    appendFileChunks(chunks, header.size(), data, size * sizeof(uint32_t));
+    if (!transferFileChunks(filename, chunks, true, num_threads)) {
+      std::cout<<"Error while writing npy file: "<<filename<<"\n";
+      return false;
+    }
+    if (!channels_info.empty()) {
+      channels_info += ", ";
+    }
+    channels_info += p.first;
+  }
+  std::cout<<"Exported npy files: "<<prefix<<", channels: "<<channels_info<<"\n";
+  return true;
+}
+
 void NebulabrotChannelCollection::merge(const NebulabrotChannelCollection& other) {
   std::string channels_info;
   for (auto& p : other.channels) {
@@ -210,8 +455,10 @@ void NebulabrotChannelCollection::merge(const NebulabrotChannelCollection& other
     if (it == channels.end()) {
       channels.emplace(p.first, p.second);
       channels_info += p.first;
+    } else if (!it->second.mergeWith(p.second)) {
+      std::cout<<"Error while merging "<<p.first<<": rendered with another estimator, not merged\n";
+      channels_info += p.first + "(not merged)";
     } else {
-      it->second.mergeWith(p.second);
       it->second.updateMaxValue();
       channels_info += p.first + "(merged)";
     }
@@ -220,32 +467,88 @@ void NebulabrotChannelCollection::merge(const NebulabrotChannelCollection& other
 }
 
 InnerFunctionData::InnerFunctionData(InnerFunc ptr, double cost)
-    : ptr(ptr), cost(cost) {}
+    : ptr(ptr), float_ptr(nullptr), double_double_ptr(nullptr), perturbation_ptr(nullptr), cost(cost) {}
+
+InnerFunctionData::InnerFunctionData(InnerFunc ptr, InnerFuncFloat float_ptr, InnerFuncDoubleDouble double_double_ptr,
+                                     double cost)
+    : ptr(ptr), float_ptr(float_ptr), double_double_ptr(double_double_ptr), perturbation_ptr(nullptr), cost(cost) {}
+
+InnerFunctionData::InnerFunctionData(InnerFunc ptr, InnerFuncFloat float_ptr, InnerFuncDoubleDouble double_double_ptr,
+                                     InnerFuncPerturbation perturbation_ptr, double cost)
+    : ptr(ptr), float_ptr(float_ptr), double_double_ptr(double_double_ptr), perturbation_ptr(perturbation_ptr),
+      cost(cost) {}
 
 NebulabrotIterationData::NebulabrotIterationData(size_t inner_iterations,
-                                                 size_t renderer_iterations, const InnerFunctionData& func)
-    : inner_iterations(inner_iterations), renderer_iterations(renderer_iterations), func(func) {}
+                                                 size_t renderer_iterations, const InnerFunctionData& func,
+                                                 RendererPrecision precision, SplatEstimator estimator)
+    : inner_iterations(inner_iterations), renderer_iterations(renderer_iterations), func(func), precision(precision),
+      estimator(estimator) {}
 
 double NebulabrotIterationData::getCost() const {
   return func.cost * renderer_iterations * (inner_iterations + 128.0 * std::pow(2.0, inner_iterations / 1024.0));
 }
 
 NebulabrotRenderChannel::NebulabrotRenderChannel(const NebulabrotIterationData& data, const std::string& name)
-    : name(name), data(data) {
+    : name(name), data(data), failed(false), precision(PRECISION_DOUBLE) {
   cost = data.getCost();
 }
 
+RendererPrecision selectPrecision(const InnerFunctionData& func, double xmid, double ymid, double factor,
+                                  size_t width, size_t height) {
+  //orbits of the mandelbrot set stay within 2 until they escape, on-screen points within the view
+  double magnitude = std::max(2.0, std::max(std::abs(xmid), std::abs(ymid)) + factor);
+  double pixel = factor * 2.0 / (width + height);
+  double roundoff = pixel / (PRECISION_ERROR_STEPS * PRECISION_PIXEL_FRACTION * magnitude);
+  if (func.float_ptr && roundoff >= std::numeric_limits<float>::epsilon() * 0.5) {
+    return PRECISION_FLOAT;
+  }
+  if (!func.double_double_ptr || roundoff >= std::numeric_limits<double>::epsilon() * 0.5) {
+    return PRECISION_DOUBLE;
+  }
+  return func.perturbation_ptr ? PRECISION_PERTURBATION : PRECISION_DOUBLE_DOUBLE;
+}
+
+const char* precisionName(RendererPrecision precision) {
+  switch (precision) {
+    case PRECISION_FLOAT:
+      return "float";
+    case PRECISION_DOUBLE:
+      return "double";
+    case PRECISION_DOUBLE_DOUBLE:
+      return "double-double";
+    case PRECISION_PERTURBATION:
+      return "perturbation";
+    default:
+      return "auto";
+  }
+}
+
+const char* estimatorName(SplatEstimator estimator) {
+  return estimator == SPLAT_EXPECTED ? "expected" : "accepted";
+}
+
+uint32_t estimatorWeightScale(SplatEstimator estimator) {
+  return estimator == SPLAT_EXPECTED ? SPLAT_WEIGHT_SCALE : 1;
+}
+
 bool NebulabrotRenderChannel::operator<(const NebulabrotRenderChannel& other) const {
   return cost < other.cost;
 }
 
-NebulabrotRenderingManager::NebulabrotRenderingManager(double xmid, double ymid, double factor,
-                                                       double random_radius, double norm_limit,
+NebulabrotRenderingManager::NebulabrotRenderingManager(const DoubleDouble& xmid, const DoubleDouble& ymid,
+                                                       double factor, double random_radius, double norm_limit,
                                                        size_t width, size_t height, size_t num_threads)
     : xmid(xmid), ymid(ymid), factor(factor), random_radius(random_radius), norm_limit(norm_limit),
-      width(width), height(height), num_threads(num_threads) {}
+      width(width), height(height), num_threads(num_threads), image_manager(nullptr), result_collection(nullptr), pool(nullptr) {}
 
 bool NebulabrotRenderingManager::add(const std::string& name, const NebulabrotIterationData& iteration_data) {
+  const MutationParameters& mutation = iteration_data.mutation;
+  if (mutation.chains == 0 || !(mutation.move_min > 0) || !(mutation.move_max >= mutation.move_min) ||
+      !(mutation.random_fraction >= 0 && mutation.random_fraction <= 1) ||
+      !(mutation.target_acceptance > 0 && mutation.target_acceptance < 1)) {
+    std::cout<<"Error while adding iteration channel to rendering manager: invalid mutation parameters (" + name + ")\n";
+    return false;
+  }
   auto insert_it = channels.begin();
   for (auto it = insert_it; it != channels.end(); ++it) {
     int comp_result = name.compare(it->name);
@@ -260,11 +563,33 @@ bool NebulabrotRenderingManager::add(const std::string& name, const NebulabrotIt
   return true;
 }
 
+void NebulabrotRenderingManager::setThreadPool(ThreadPool* pool) {
+  this->pool = pool;
+}
+
+ThreadPool& NebulabrotRenderingManager::getThreadPool() {
+  return pool ? *pool : ThreadPool::shared();
+}
+
 NebulabrotChannelCollection NebulabrotRenderingManager::execute() {
-  std::lock_guard<std::mutex> lock(execute_mutex);
   NebulabrotChannelCollection result(width, height);
+  execute(result, nullptr);
+  return result;
+}
+
+bool NebulabrotRenderingManager::execute(NebulabrotChannelCollection& result, ImageRenderingManager* images) {
+  std::lock_guard<std::mutex> lock(execute_mutex);
+  if (result.getWidth() != width || result.getHeight() != height) {
+    std::cout<<"Error while rendering: collection resolution doesn't match\n";
+    return false;
+  }
+  image_manager = images;
+  result_collection = &result;
   if (channels.empty()) {
-    return result;
+    if (images) {
+      images->execute();
+    }
+    return true;
   }
   render_start = std::chrono::high_resolution_clock::now();
   std::string starting_message = "Computing fractal (";
@@ -273,18 +598,52 @@ NebulabrotChannelCollection NebulabrotRenderingManager::execute() {
   for (auto& ch : channels) {
     total_cost += ch.cost;
   }
-  size_t approx_num_jobs = num_threads * 3 + static_cast<size_t>(std::log2(total_cost));
+  size_t approx_num_jobs = deterministic ? std::max((size_t) 1, deterministic_jobs)
+                                         : num_threads * 3 + static_cast<size_t>(std::log2(total_cost));
   jobs_total = 0;
   jobs_finished = 0;
   last_notification_elapsed = 0;
+  num_nodes = NumaTopology::get().getNumNodes();
+  node_mutexes.reset(new std::mutex[num_nodes]);
+  //unpinned workers migrate between nodes, the node a merge runs on says nothing about where its pages stay
+  bool per_node_merges = num_nodes > 1 && getThreadPool().isPinned();
   for (auto& ch : channels) {
+    ch.buf = nullptr;
+    ch.node_bufs.clear();
+    if (per_node_merges) {
+      ch.node_bufs.resize(num_nodes);
+    }
+    ch.unfinished_jobs = 0;
+    ch.threads_on_channel = 0;
+    ch.iteration_jobs.clear();
+    ch.failed = false;
     if (ch.data.inner_iterations < 2) {
       std::cout<<"Channel " + ch.name + " has less than 2 inner iterations, the rendering would never end\n";
       continue;
     }
+    ch.precision = ch.data.precision;
+    if ((ch.precision == PRECISION_FLOAT && !ch.data.func.float_ptr) ||
+        (ch.precision == PRECISION_DOUBLE_DOUBLE && !ch.data.func.double_double_ptr) ||
+        (ch.precision == PRECISION_PERTURBATION && (!ch.data.func.double_double_ptr || !ch.data.func.perturbation_ptr))) {
+      std::cout<<"Channel " + ch.name + " has no " + precisionName(ch.precision) + " function, selecting precision\n";
+      ch.precision = PRECISION_AUTO;
+    }
+    if (ch.precision == PRECISION_AUTO) {
+      ch.precision = selectPrecision(ch.data.func, (double) xmid, (double) ymid, factor, width, height);
+    }
     auto it = result.channels.emplace_hint(result.channels.end(), ch.name, NebulabrotChannelBuffer(width, height));
+    //counts loaded from a file can only be continued with the estimator that rendered them
+    uint32_t weight_scale = estimatorWeightScale(ch.data.estimator);
+    if (it->second.completed_iterations > 0 && it->second.weight_scale != weight_scale) {
+      std::cout<<"Channel " + ch.name + " was rendered with another estimator, it can't be continued with "
+                 + estimatorName(ch.data.estimator) + "\n";
+      continue;
+    }
+    it->second.weight_scale = weight_scale;
     ch.buf = &it->second;
-    size_t ch_jobs = std::max((size_t) 1, (size_t) (ch.cost / total_cost * approx_num_jobs));
+    //deterministic jobs depend on the channel alone, so that adding or removing another one keeps its bits
+    size_t ch_jobs = deterministic ? approx_num_jobs
+                                   : std::max((size_t) 1, (size_t) (ch.cost / total_cost * approx_num_jobs));
     size_t iterations_per_job_base = ch.data.renderer_iterations / ch_jobs;
     size_t iterations_per_job_rem = ch.data.renderer_iterations % ch_jobs;
     ch.iteration_jobs.resize(ch_jobs);
@@ -306,95 +665,303 @@ NebulabrotChannelCollection NebulabrotRenderingManager::execute() {
   starting_message += ")\n";
   if (jobs_total == 0) {
     std::cout<<"No channels to render\n";
-    return result;
+    if (images) {
+      images->execute();
+    }
+    return true;
   } else {
     std::cout<<starting_message;
   }
-#ifdef RENDERING_DEBUG
-  std::cout<<std::endl<<"Number of segments: "<<jobs_total<<" ("<<approx_num_jobs<<")\n";
-#endif
-  std::vector<std::thread> threads;
-  size_t temp_channel_num = channels.size() - 1;
+  Trace::instant("render jobs", "render", "jobs", jobs_total);
   {
-    std::lock_guard<std::mutex> lock1(leave_mutex);
-    for (size_t i = 0; i < num_threads; ++i) {
-      channels[temp_channel_num].threads_on_channel++;
-      threads.emplace_back(&NebulabrotRenderingManager::threadFunction, this, temp_channel_num, i);
-      if (temp_channel_num == 0) {
-        temp_channel_num = channels.size() - 1;
-      } else {
-        temp_channel_num--;
+    std::lock_guard<std::mutex> metrics_lock(metrics_mutex);
+    channel_metrics.assign(channels.size(), RenderChannelMetrics());
+    for (size_t i = 0; i < channels.size(); ++i) {
+      channel_metrics[i].name = channels[i].name;
+      channel_metrics[i].inner_iterations = channels[i].data.inner_iterations;
+      channel_metrics[i].precision = channels[i].precision;
+      channel_metrics[i].estimator = channels[i].data.estimator;
+      channel_metrics[i].mutation = channels[i].data.mutation;
+    }
+    thread_metrics.assign(num_threads, RenderThreadMetrics());
+    running = true;
+  }
+  if (images) {
+    std::vector<std::pair<NebulabrotChannelCollection*, std::string>> pending;
+    for (auto& ch : channels) {
+      if (ch.buf) {
+        pending.emplace_back(&result, ch.name);
       }
     }
+    images->begin(pending);
   }
+  //threads register on channels when they take their first job there, not when they start
+  std::vector<size_t> start_channels(num_threads);
   for (size_t i = 0; i < num_threads; ++i) {
-    threads[i].join();
+    start_channels[i] = channels.size() - 1 - i % channels.size();
   }
+  getThreadPool().run(num_threads, [&](size_t i) { threadFunction(start_channels[i], i); });
   double time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - render_start).count();
   std::cout<<"Computing ended in "<<time<<std::endl;
-  return result;
+  {
+    std::lock_guard<std::mutex> metrics_lock(metrics_mutex);
+    running = false;
+    run_time = time;
+  }
+  if (!metrics_file.empty()) {
+    std::ofstream fs(metrics_file);
+    fs<<getMetricsJson();
+    if (!fs.good()) {
+      std::cout<<"Unable to write metrics file: "<<metrics_file<<"\n";
+    }
+  }
+  if (images) {
+    images->finish();
+  }
+  bool all_rendered = true;
+  for (auto& ch : channels) {
+    if (ch.failed) {
+      std::cout<<"Channel " + ch.name + " failed, it holds only the jobs finished before\n";
+      all_rendered = false;
+    }
+  }
+  return all_rendered;
+}
+
+void NebulabrotRenderingManager::setMetricsFile(const std::string& filename) {
+  metrics_file = filename;
+}
+
+void NebulabrotRenderingManager::setPerfCounters(bool enabled) {
+  perf_counters = enabled;
+}
+
+void NebulabrotRenderingManager::setRandomGenerator(RandomGenerator generator) {
+  random_generator = generator;
+}
+
+void NebulabrotRenderingManager::setDeterministic(bool enabled, uint64_t seed, size_t num_jobs) {
+  deterministic = enabled;
+  deterministic_seed = seed;
+  deterministic_jobs = num_jobs;
+}
+
+std::string NebulabrotRenderingManager::getMetricsJson() const {
+  std::lock_guard<std::mutex> lock(metrics_mutex);
+  double elapsed = running ? secondsSince(render_start) : run_time;
+  std::ostringstream os;
+  os<<"{\n  \"running\": "<<(running ? "true" : "false")<<",\n  \"elapsed\": "<<elapsed
+    <<",\n  \"width\": "<<width<<",\n  \"height\": "<<height<<",\n  \"threads\": "<<thread_metrics.size()
+    <<",\n  \"numa_nodes\": "<<num_nodes<<",\n  \"kernels\": \""<<getCpuKernels().name<<"\""
+    <<",\n  \"deterministic\": "<<(deterministic ? "true" : "false")<<",\n  \"peak_rss_bytes\": "<<peakMemoryBytes();
+  bool perf_available = false;
+  for (const RenderThreadMetrics& th : thread_metrics) {
+    perf_available = perf_available || th.perf_available;
+  }
+  os<<",\n  \"perf_counters\": \""<<(!perf_counters ? "disabled" : perf_available ? "enabled" : "unavailable")<<"\"";
+  os<<",\n  \"channels\": [";
+  for (size_t i = 0; i < channel_metrics.size(); ++i) {
+    const RenderChannelMetrics& ch = channel_metrics[i];
+    double proposals = std::max((uint64_t) 1, ch.proposals);
+    os<<(i ? ",\n" : "\n")<<"    {\"name\": "<<jsonString(ch.name)<<", \"inner_iterations\": "<<ch.inner_iterations
+      <<", \"precision\": \""<<precisionName(ch.precision)<<"\""
+      <<", \"estimator\": \""<<estimatorName(ch.estimator)<<"\""
+      <<", \"mutation\": "<<mutationJson(ch)
+      <<", \"orbits\": "<<ch.proposals<<", \"orbits_per_second\": "<<(ch.render_time > 0 ? ch.proposals / ch.render_time : 0)
+      <<", \"acceptance_rate\": "<<ch.accepted / proposals
+      <<", \"rejected_non_escaping\": "<<ch.rejected_non_escaping / proposals
+      <<", \"rejected_off_screen\": "<<ch.rejected_off_screen / proposals
+      <<", \"glitch_rate\": "<<ch.glitches / proposals<<", \"recompute_rate\": "<<ch.recomputed / proposals
+      <<", \"render_time\": "<<ch.render_time<<", \"seed_time\": "<<ch.seed_time<<", \"merge_time\": "<<ch.merge_time
+      <<", \"start\": "<<ch.start<<", \"finish\": "<<ch.finish<<"}";
+  }
+  os<<"\n  ],\n  \"thread_metrics\": [";
+  for (size_t i = 0; i < thread_metrics.size(); ++i) {
+    const RenderThreadMetrics& th = thread_metrics[i];
+    //time of the run not spent on any work, including waiting for the last jobs of other threads
+    double busy = th.render_time + th.seed_time + th.merge_time + th.image_time;
+    double idle = std::max(0.0, elapsed - busy);
+    os<<(i ? ",\n" : "\n")<<"    {\"thread\": "<<i<<", \"jobs\": "<<th.jobs<<", \"orbits\": "<<th.proposals
+      <<", \"orbits_per_second\": "<<(th.render_time > 0 ? th.proposals / th.render_time : 0)
+      <<", \"render_time\": "<<th.render_time<<", \"seed_time\": "<<th.seed_time<<", \"merge_time\": "<<th.merge_time
+      <<", \"image_time\": "<<th.image_time<<", \"idle_time\": "<<idle<<", \"start\": "<<th.start<<", \"finish\": "<<th.finish;
+    if (th.perf_available) {
+      os<<",\n     \"perf\": {\"render\": "<<th.perf_render.toJson()<<", \"seed\": "<<th.perf_seed.toJson()
+        <<", \"merge\": "<<th.perf_merge.toJson()<<", \"image\": "<<th.perf_image.toJson()<<"}";
+    }
+    os<<"}";
+  }
+  os<<"\n  ]\n}\n";
+  return os.str();
 }
 
 const size_t NO_CHANNEL = (size_t) -1;
 
 void NebulabrotRenderingManager::threadFunction(size_t start_channel, size_t thread_num) {
-  std::unique_ptr<BuddhabrotRenderer<double>> renderer;
+  std::unique_ptr<OrbitRenderer> renderer;
+  const CpuKernels& kernels = getCpuKernels();
   size_t previous_channel = NO_CHANNEL;
   NebulabrotChannelBuffer buf(width, height);
-#ifdef RENDERING_DEBUG
-  auto time_begin = std::chrono::high_resolution_clock::now();
-  std::cout<<"Thread " + std::to_string(thread_num) + " started on channel " + std::to_string(start_channel) + "\n";
-#endif
+  std::unique_ptr<PerfCounters> perf(perf_counters ? new PerfCounters() : nullptr);
+  auto readPerf = [&perf]() { return perf ? perf->read() : PerfValues(); };
+  {
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    thread_metrics[thread_num].start = secondsSince(render_start);
+    thread_metrics[thread_num].perf_available = perf && perf->isAvailable();
+  }
   while(true) {
     IterJobData job = getAJob(start_channel);
     if (job.iter_data.renderer_iterations == 0) {
       if (previous_channel < channels.size()) {
-        leaveChannel(previous_channel, NO_CHANNEL, thread_num, buf);
+        auto merge_begin = std::chrono::high_resolution_clock::now();
+        PerfValues merge_perf = readPerf();
+        leaveChannel(previous_channel, NO_CHANNEL, buf);
+        double merge_time = secondsSince(merge_begin);
+        std::lock_guard<std::mutex> lock(metrics_mutex);
+        channel_metrics[previous_channel].merge_time += merge_time;
+        thread_metrics[thread_num].merge_time += merge_time;
+        thread_metrics[thread_num].perf_merge.add(merge_perf, readPerf());
       }
-#ifdef RENDERING_DEBUG
-      std::cout<<"Thread " + std::to_string(thread_num) + " terminated (no more jobs)\n";
-#endif
+      std::lock_guard<std::mutex> lock(metrics_mutex);
+      thread_metrics[thread_num].finish = secondsSince(render_start);
       return;
     }
     start_channel = job.num_channel;
+    bool job_failed = false;
     if (previous_channel != start_channel) {
-      renderer.reset(new BuddhabrotRenderer<double>
-               (width, height, job.iter_data.inner_iterations, 16, job.iter_data.func.ptr, random_radius, norm_limit));
-      renderer->setArea(xmid, ymid, factor);
-      try {
-        renderer->prepareInitialPoints();
-      } catch (const std::runtime_error& e) {
-        std::cout<<std::string(e.what()) + "\n";
-        return;
+      auto seed_begin = std::chrono::high_resolution_clock::now();
+      PerfValues seed_perf = readPerf();
+      {
+        TraceScope trace("seed search", "render", "channel", start_channel);
+        //a deterministic job runs one chain as long as all chains of a normal job together, so the number of chains
+        //(and the bias of their starting points) is that of a normal render on num_jobs / chains threads
+        renderer.reset(kernels.createRenderer(width, height, job.iter_data.inner_iterations,
+                                              deterministic ? 1 : job.iter_data.mutation.chains, job.iter_data.func,
+                                              random_radius, norm_limit, deterministic ? RANDOM_PHILOX : random_generator,
+                                              channels[start_channel].precision));
+        renderer->setArea(xmid, ymid, factor);
+        renderer->setSplatEstimator(job.iter_data.estimator);
+        renderer->setMutation(job.iter_data.mutation);
+        //deterministic jobs find their initial points and tune themselves
+        try {
+          if (!deterministic) {
+            renderer->prepareInitialPoints();
+            renderer->tuneMutation();
+            if (job.iter_data.mutation.adaptive) {
+              recordMutation(start_channel, renderer->getMutation());
+            }
+          }
+        } catch (const std::runtime_error& e) {
+          failChannel(start_channel, e.what());
+          job_failed = true;
+        }
+      }
+      double seed_time = secondsSince(seed_begin);
+      PerfValues merge_perf = readPerf();
+      auto merge_begin = std::chrono::high_resolution_clock::now();
+      leaveChannel(previous_channel, start_channel, buf);
+      double merge_time = secondsSince(merge_begin);
+      {
+        std::lock_guard<std::mutex> lock(metrics_mutex);
+        channel_metrics[start_channel].seed_time += seed_time;
+        thread_metrics[thread_num].seed_time += seed_time;
+        thread_metrics[thread_num].perf_seed.add(seed_perf, merge_perf);
+        if (previous_channel != NO_CHANNEL) {
+          channel_metrics[previous_channel].merge_time += merge_time;
+          thread_metrics[thread_num].merge_time += merge_time;
+          thread_metrics[thread_num].perf_merge.add(merge_perf, readPerf());
+        }
       }
       if (previous_channel != NO_CHANNEL) {
-        leaveChannel(previous_channel, start_channel, thread_num, buf);
         buf.clear();
-#ifdef RENDERING_DEBUG
-        std::cout<<"Thread " + std::to_string(thread_num) + " changed channel " + std::to_string(previous_channel) + " -> " + std::to_string(start_channel) + "\n";
-#endif
       }
+      buf.weight_scale = estimatorWeightScale(job.iter_data.estimator);
     }
-#ifdef RENDERING_DEBUG
-    auto time_begin = std::chrono::high_resolution_clock::now();
-#endif
-    renderer->outputPointValues(buf.getData(), job.iter_data.renderer_iterations);
-    buf.completed_iterations += job.iter_data.renderer_iterations;
-#ifdef RENDERING_DEBUG
-    double time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - time_begin).count();
-    std::cout<<"Thread " + std::to_string(thread_num) + " completed job; channel: " + std::to_string(start_channel)
-      + ", inner it: " + std::to_string(job.iter_data.inner_iterations) + ", it:" + std::to_string(job.iter_data.renderer_iterations)
-      + " in " + std::to_string(time) + "s\n";
-#endif
+    auto job_begin = std::chrono::high_resolution_clock::now();
+    PerfValues job_perf = readPerf();
+    {
+      TraceScope trace("render job", "render", "channel", start_channel);
+      try {
+        if (!job_failed && deterministic) {
+          uint64_t key = jobKey(deterministic_seed, channels[start_channel].name, job.job_index);
+          renderer->outputSeededPointValues(buf.getData(),
+                                            job.iter_data.renderer_iterations * job.iter_data.mutation.chains, key);
+          if (job.iter_data.mutation.adaptive) {
+            recordMutation(start_channel, renderer->getMutation());
+          }
+        } else if (!job_failed) {
+          renderer->outputPointValues(buf.getData(), job.iter_data.renderer_iterations);
+        }
+      } catch (const std::runtime_error& e) {
+        failChannel(start_channel, e.what());
+        job_failed = true;
+      }
+    }
+    //partial counts of a failed job can't be told apart from the thread's earlier ones of the channel, all of them
+    //are dropped with their iterations
+    if (job_failed) {
+      buf.clear();
+    } else {
+      buf.completed_iterations += job.iter_data.renderer_iterations;
+    }
+    double job_time = secondsSince(job_begin);
+    if (perf) {
+      PerfValues job_perf_end = perf->read();
+      std::lock_guard<std::mutex> lock(metrics_mutex);
+      thread_metrics[thread_num].perf_render.add(job_perf, job_perf_end);
+    }
+    recordJob(thread_num, start_channel, renderer->getStats(), job_time);
+    renderer->resetStats();
     previous_channel = start_channel;
     notifyJobCompletion(start_channel);
+    if (image_manager) {
+      auto image_begin = std::chrono::high_resolution_clock::now();
+      PerfValues image_perf = readPerf();
+      if (image_manager->runAvailableJob()) {
+        double image_time = secondsSince(image_begin);
+        PerfValues image_perf_end = readPerf();
+        std::lock_guard<std::mutex> lock(metrics_mutex);
+        thread_metrics[thread_num].image_time += image_time;
+        thread_metrics[thread_num].perf_image.add(image_perf, image_perf_end);
+      }
+    }
   }
 }
 
+void NebulabrotRenderingManager::recordJob(size_t thread_num, size_t channel_id, const RendererStats& stats,
+                                           double render_time) {
+  std::lock_guard<std::mutex> lock(metrics_mutex);
+  RenderChannelMetrics& ch = channel_metrics[channel_id];
+  if (ch.start < 0) {
+    ch.start = secondsSince(render_start) - render_time;
+  }
+  ch.proposals += stats.proposals;
+  ch.accepted += stats.accepted;
+  ch.rejected_non_escaping += stats.rejected_non_escaping;
+  ch.rejected_off_screen += stats.rejected_off_screen;
+  ch.glitches += stats.glitches;
+  ch.recomputed += stats.recomputed;
+  ch.render_time += render_time;
+  RenderThreadMetrics& th = thread_metrics[thread_num];
+  th.jobs++;
+  th.proposals += stats.proposals;
+  th.render_time += render_time;
+}
+
+void NebulabrotRenderingManager::recordMutation(size_t channel_id, const MutationParameters& tuned) {
+  std::lock_guard<std::mutex> lock(metrics_mutex);
+  RenderChannelMetrics& ch = channel_metrics[channel_id];
+  ch.tuned_random_fraction += tuned.random_fraction;
+  ch.tuned_move_min += tuned.move_min;
+  ch.tuned_move_max += tuned.move_max;
+  ch.tunings++;
+}
+
 IterJobData::IterJobData()
-    : iter_data(0, 0, InnerFunctionData(nullptr, 0)) {}
+    : iter_data(0, 0, InnerFunctionData(nullptr, 0)), buf(nullptr), num_channel(0), job_index(0) {}
 
 IterJobData NebulabrotRenderingManager::getAJob(size_t preferred_channel) {
+  TraceScope trace("get job", "render");
   std::lock_guard<std::mutex> lock(job_getter_mutex);
   IterJobData result;
   bool found = false;
@@ -403,6 +970,7 @@ IterJobData NebulabrotRenderingManager::getAJob(size_t preferred_channel) {
     size_t vec_size = channels[preferred_channel].iteration_jobs.size();
     if (vec_size > 0) {
       result.iter_data.renderer_iterations = channels[preferred_channel].iteration_jobs[vec_size-1];
+      result.job_index = vec_size - 1;
       channels[preferred_channel].iteration_jobs.pop_back();
       found = true;
       break;
@@ -418,6 +986,8 @@ IterJobData NebulabrotRenderingManager::getAJob(size_t preferred_channel) {
   }
   result.iter_data.inner_iterations = channels[preferred_channel].data.inner_iterations;
   result.iter_data.func = channels[preferred_channel].data.func;
+  result.iter_data.estimator = channels[preferred_channel].data.estimator;
+  result.iter_data.mutation = channels[preferred_channel].data.mutation;
   result.num_channel = preferred_channel;
   result.buf = channels[preferred_channel].buf;
   return result;
@@ -438,21 +1008,69 @@ void NebulabrotRenderingManager::notifyJobCompletion(size_t channel_id) {
   }
 }
 
-void NebulabrotRenderingManager::leaveChannel(size_t previous_channel, size_t new_channel, size_t thread_num, const NebulabrotChannelBuffer& buf) {
-  channels[previous_channel].buf->mergeWith(buf);
-#ifdef RENDERING_DEBUG
-  std::cout<<"Thread " + std::to_string(thread_num) + " merged channel " + std::to_string(previous_channel) + "\n";
-#endif
-  std::lock_guard<std::mutex> lock(leave_mutex);
-  if (new_channel != NO_CHANNEL) {
+//drops the remaining jobs of a channel after one of its jobs threw, the jobs other threads are running still finish
+void NebulabrotRenderingManager::failChannel(size_t channel_id, const std::string& error) {
+  size_t dropped_jobs;
+  {
+    std::lock_guard<std::mutex> lock(job_getter_mutex);
+    channels[channel_id].failed = true;
+    dropped_jobs = channels[channel_id].iteration_jobs.size();
+    channels[channel_id].iteration_jobs.clear();
+  }
+  std::cout<<"Error while rendering channel " + channels[channel_id].name + ": " + error + "\n";
+  for (size_t i = 0; i < dropped_jobs; ++i) {
+    notifyJobCompletion(channel_id);
+  }
+}
+
+void NebulabrotRenderingManager::leaveChannel(size_t previous_channel, size_t new_channel, const NebulabrotChannelBuffer& buf) {
+  if (previous_channel == NO_CHANNEL) {
+    std::lock_guard<std::mutex> lock(leave_mutex);
     channels[new_channel].threads_on_channel++;
+    return;
   }
-  if (previous_channel != NO_CHANNEL) {
+  TraceScope trace("merge", "render", "channel", previous_channel);
+  NebulabrotRenderChannel& prev = channels[previous_channel];
+  if (prev.node_bufs.empty()) {
+    prev.buf->mergeWith(buf);
+  } else {
+    size_t node = NumaTopology::get().getCurrentNode();
+    {
+      std::lock_guard<std::mutex> lock(node_mutexes[node]);
+      if (!prev.node_bufs[node]) {
+        prev.node_bufs[node].reset(new NebulabrotChannelBuffer(width, height));
+      }
+    }
+    prev.node_bufs[node]->mergeWith(buf);
+  }
+  bool channel_finished = false;
+  {
+    std::lock_guard<std::mutex> lock(leave_mutex);
+    if (new_channel != NO_CHANNEL) {
+      channels[new_channel].threads_on_channel++;
+    }
     channels[previous_channel].threads_on_channel--;
     if (channels[previous_channel].threads_on_channel == 0 && channels[previous_channel].unfinished_jobs == 0) {
-      channels[previous_channel].buf->updateMaxValue();
+      channel_finished = true;
     }
   }
+  if (!channel_finished) {
+    return;
+  }
+  for (auto& node_buf : prev.node_bufs) {
+    if (node_buf) {
+      prev.buf->mergeWith(*node_buf);
+      node_buf.reset();
+    }
+  }
+  prev.buf->updateMaxValue();
+  {
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    channel_metrics[previous_channel].finish = secondsSince(render_start);
+  }
+  if (image_manager) {
+    image_manager->channelReady(result_collection, prev.name);
+  }
 }
 
 ImageColorBuffer::ImageColorBuffer(size_t width, size_t height)
@@ -477,12 +1095,12 @@ ImageColorBuffer::~ImageColorBuffer() {
   delete[] data;
 }
 
-bool ImageColorBuffer::saveFile(const std::string& filename) {
+bool ImageColorBuffer::saveFile(const std::string& filename, PngCompression compression, size_t num_threads) {
   std::string actual_filename = filename;
   while(file_exists(actual_filename)) {
     actual_filename += '_';
   }
-  bool success =  (bool) stbi_write_png((actual_filename + ".png").c_str(), (int) width, (int) height, 4, data, (int) width*4);
+  bool success = writePng(actual_filename + ".png", width, height, data, compression, num_threads);
   if (success) {
     std::cout<<"Saved image " + actual_filename + "\n";
   } else {
@@ -491,15 +1109,123 @@ bool ImageColorBuffer::saveFile(const std::string& filename) {
   return success;
 }
 
+ChannelTransfer::ChannelTransfer(TransferCurve curve, double param)
+    : curve(curve), param(param) {}
+
+double ChannelTransfer::apply(double value) const {
+  switch (curve) {
+    case CURVE_SQRT:
+      return std::sqrt(value);
+    case CURVE_POW:
+      return std::pow(value, param);
+    case CURVE_LOG:
+      return std::log1p(param * value) / std::log1p(param);
+    default:
+      return value;
+  }
+}
+
+ImageWriterQueue::ImageWriterQueue(size_t num_writers, size_t capacity, PngCompression compression, size_t encode_threads)
+    : capacity(std::max((size_t) 1, capacity)), compression(compression), encode_threads(encode_threads),
+      finishing(false), max_depth(0), encode_time(0), images_written(0) {
+  for (size_t i = 0; i < std::max((size_t) 1, num_writers); ++i) {
+    writers.emplace_back(&ImageWriterQueue::writerFunction, this, i);
+  }
+}
+
+ImageWriterQueue::~ImageWriterQueue() {
+  finish();
+}
+
+void ImageWriterQueue::push(ImageColorBuffer* buf, const std::string& filename) {
+  TraceScope trace("queue image", "io");
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  not_full.wait(lock, [this]() { return queue.size() < capacity; });
+  queue.emplace_back(buf, filename);
+  max_depth = std::max(max_depth, queue.size());
+  Trace::counter("writer queue", "io", queue.size());
+  not_empty.notify_one();
+}
+
+void ImageWriterQueue::finish() {
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    finishing = true;
+  }
+  not_empty.notify_all();
+  for (auto& th : writers) {
+    th.join();
+  }
+  writers.clear();
+}
+
+size_t ImageWriterQueue::getMaxDepth() const {
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  return max_depth;
+}
+
+double ImageWriterQueue::getEncodeTime() const {
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  return encode_time;
+}
+
+size_t ImageWriterQueue::getImagesWritten() const {
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  return images_written;
+}
+
+void ImageWriterQueue::writerFunction(size_t writer_num) {
+  Trace::setThreadName("image writer " + std::to_string(writer_num));
+  while (true) {
+    std::pair<ImageColorBuffer*, std::string> item;
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex);
+      not_empty.wait(lock, [this]() { return !queue.empty() || finishing; });
+      if (queue.empty()) {
+        return;
+      }
+      item = queue.front();
+      queue.pop_front();
+      Trace::counter("writer queue", "io", queue.size());
+      not_full.notify_one();
+    }
+    auto time_begin = std::chrono::high_resolution_clock::now();
+    {
+      TraceScope trace("save png", "io");
+      item.first->saveFile(item.second, compression, encode_threads);
+    }
+    double time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - time_begin).count();
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    encode_time += time;
+    images_written++;
+  }
+}
+
 ImageFunctionData::ImageFunctionData(ImagePixelFunc ptr, const std::vector<std::string>& channel_names,
                                      const std::vector<double>& desired_max, double cost)
-    : mode(ImageMode::PIXEL_FUNC), channel_names(channel_names), desired_max(desired_max), cost(cost) {
+    : mode(ImageMode::PIXEL_FUNC), channel_names(channel_names), desired_max(desired_max),
+      phases(1), reduction_size(0), histogram_bins(0), cost(cost) {
   this->ptr.pixel = ptr;
 }
 
+ImageFunctionData::ImageFunctionData(ImageSpanFunc ptr, const std::vector<std::string>& channel_names,
+                                     const std::vector<double>& desired_max, double cost)
+    : mode(ImageMode::SPAN_FUNC), channel_names(channel_names), desired_max(desired_max),
+      phases(1), reduction_size(0), histogram_bins(0), cost(cost) {
+  this->ptr.span = ptr;
+}
+
+ImageFunctionData::ImageFunctionData(TiledImageFunc ptr, const std::vector<std::string>& channel_names, size_t phases,
+                                     size_t reduction_size, size_t histogram_bins, double cost)
+    : mode(ImageMode::TILED_FUNC), channel_names(channel_names), phases(std::max((size_t) 1, phases)),
+      reduction_size(reduction_size), histogram_bins(histogram_bins), cost(cost) {
+  this->ptr.tiled = ptr;
+}
+
 ImageFunctionData::ImageFunctionData(WholeImageFunc ptr, const std::vector<std::string>& channel_names,
                                      const std::vector<double>& desired_max, double cost)
-    : mode(ImageMode::IMAGE_FUNC), channel_names(channel_names), desired_max(desired_max), cost(cost) {
+    : mode(ImageMode::IMAGE_FUNC), channel_names(channel_names), desired_max(desired_max),
+      phases(1), reduction_size(0), histogram_bins(0), cost(cost) {
   this->ptr.whole = ptr;
 }
 
@@ -511,20 +1237,53 @@ double ImageOutputData::getCost() const {
 }
 
 ImageRenderChannel::ImageRenderChannel(const ImageOutputData& output_data, const std::string& filename)
-    : cost(output_data.getCost()), filename(filename), output_data(output_data), failed(false) {}
+    : cost(output_data.getCost()), filename(filename), output_data(output_data), buf(nullptr), planned(false) {}
 
-bool ImageRenderChannel::operator<(const ImageRenderChannel& other) const {
-  if (output_data.func.mode != other.output_data.func.mode) {
-    return output_data.func.mode < other.output_data.func.mode;
+bool ImagePassInput::sameAs(const ImagePassInput& other) const {
+  if (has_transfer != other.has_transfer) {
+    return false;
+  }
+  if (has_transfer && (transfer.curve != other.transfer.curve || transfer.param != other.transfer.param)) {
+    return false;
+  }
+  return buf == other.buf && scale == other.scale;
+}
+
+ImageRenderPass::ImageRenderPass(ImageMode mode, NebulabrotChannelCollection* channels)
+    : mode(mode), channels(channels), cost(0), unfinished_jobs(0), phase(0), num_phases(1) {}
+
+bool ImageRenderPass::operator<(const ImageRenderPass& other) const {
+  if ((mode == ImageMode::IMAGE_FUNC) != (other.mode == ImageMode::IMAGE_FUNC)) {
+    return other.mode == ImageMode::IMAGE_FUNC;
   }
   return cost < other.cost;
 }
 
 ImageJobData::ImageJobData()
-    : output_data(ImageFunctionData((ImagePixelFunc) 0, {}, {}), nullptr), start_index(0), end_index(0) {}
+    : start_index(0), end_index(0), tile(0), num_pass(0), pass(nullptr) {}
 
 ImageRenderingManager::ImageRenderingManager(size_t num_threads)
-    : num_threads(num_threads) {}
+    : num_threads(num_threads), num_writers(0), png_compression(PNG_DEFAULT), pool(nullptr) {}
+
+void ImageRenderingManager::setWriterThreads(size_t num_writers) {
+  this->num_writers = num_writers;
+}
+
+void ImageRenderingManager::setThreadPool(ThreadPool* pool) {
+  this->pool = pool;
+}
+
+void ImageRenderingManager::setSaveImages(bool save) {
+  save_images = save;
+}
+
+ThreadPool& ImageRenderingManager::getThreadPool() {
+  return pool ? *pool : ThreadPool::shared();
+}
+
+void ImageRenderingManager::setPngCompression(PngCompression compression) {
+  png_compression = compression;
+}
 
 bool ImageRenderingManager::add(const std::string& filename, const ImageOutputData& image_data) {
   auto insert_it = images.begin();
@@ -541,212 +1300,471 @@ bool ImageRenderingManager::add(const std::string& filename, const ImageOutputDa
   return true;
 }
 
-void ImageRenderingManager::execute() {
-  std::lock_guard<std::mutex> lock(execute_mutex);
-  std::vector<ImageColorBuffer> image_buffers;
-  if (images.empty()) {
-    return;
+//resolves channels of the image and puts it into a pass, images sharing a collection share the pass
+bool ImageRenderingManager::addToPlan(size_t image_id, std::vector<ImageRenderPass>& new_passes) {
+  ImageRenderChannel& im = images[image_id];
+  const ImageFunctionData& func = im.output_data.func;
+  size_t num_channels = func.channel_names.size();
+  std::vector<double> desired_max = func.desired_max;
+  if (desired_max.empty()) {
+    desired_max.resize(num_channels);
+  } else if (desired_max.size() != num_channels) {
+    std::cout << "Error while saving image " + im.filename + ": desired_max vector has wrong size\n";
+    return false;
+  }
+  if (!func.transfers.empty() && func.transfers.size() != num_channels) {
+    std::cout << "Error while saving image " + im.filename + ": transfers vector has wrong size\n";
+    return false;
+  }
+  std::vector<ImagePassInput> inputs;
+  for (size_t j = 0; j < num_channels; ++j) {
+    auto it = im.output_data.channels->channels.find(func.channel_names[j]);
+    if (it == im.output_data.channels->channels.end()) {
+      std::cout<<"Error while saving image " + im.filename + ": no channel named " + func.channel_names[j] + "\n";
+      return false;
+    }
+    uint32_t max_value = it->second.getMaxValue();
+    if (max_value == 0) {
+      it->second.updateMaxValue();
+      max_value = it->second.getMaxValue();
+    }
+    double multiplier = 1.0;
+    if (desired_max[j] > 0.0) {
+      multiplier = desired_max[j] * it->second.completed_iterations * it->second.weight_scale / max_value;
+    }
+    ImagePassInput input;
+    input.buf = &it->second;
+    input.data = it->second.getData();
+    input.max_value = max_value;
+    input.scale = max_value > 0 ? multiplier / max_value : 0.0;
+    input.has_transfer = !func.transfers.empty();
+    input.transfer = input.has_transfer ? func.transfers[j] : ChannelTransfer();
+    input.table = nullptr;
+    input.table_shift = 0;
+    inputs.push_back(input);
   }
-  std::cout<<"Saving images:\n";
-  render_start = std::chrono::high_resolution_clock::now();
 
-  std::sort(images.begin(), images.end());
-  double total_cost = 0.0;
-  for (auto& im : images) {
-    total_cost += im.cost;
-    image_buffers.emplace_back(im.output_data.channels->getWidth(), im.output_data.channels->getHeight());
+  auto pass_it = new_passes.end();
+  bool fused = func.mode == ImageMode::PIXEL_FUNC || func.mode == ImageMode::SPAN_FUNC;
+  if (fused) {
+    for (auto it = new_passes.begin(); it != new_passes.end(); ++it) {
+      bool pass_fused = it->mode == ImageMode::PIXEL_FUNC || it->mode == ImageMode::SPAN_FUNC;
+      if (pass_fused && it->channels == im.output_data.channels) {
+        pass_it = it;
+        break;
+      }
+    }
   }
-  size_t approx_num_jobs = num_threads * 3 + static_cast<size_t>(std::log2(total_cost));
+  if (pass_it == new_passes.end()) {
+    new_passes.emplace_back(func.mode, im.output_data.channels);
+    pass_it = new_passes.end() - 1;
+  }
+  im.inputs.clear();
+  for (auto& input : inputs) {
+    size_t index = 0;
+    while (index < pass_it->inputs.size() && !pass_it->inputs[index].sameAs(input)) {
+      index++;
+    }
+    if (index == pass_it->inputs.size()) {
+      if (input.has_transfer) {
+        input.table = getLookupTable(input.buf, input.transfer, input.scale, input.max_value, input.table_shift);
+      }
+      pass_it->inputs.push_back(input);
+    }
+    im.inputs.push_back(index);
+  }
+  pass_it->images.push_back(image_id);
+  pass_it->cost += im.cost;
+  if (func.mode == ImageMode::TILED_FUNC) {
+    pass_it->num_phases = func.phases + (func.histogram_bins > 0 ? 1 : 0);
+    pass_it->histograms.assign(func.histogram_bins > 0 ? num_channels : 0, std::vector<uint64_t>());
+  }
+  return true;
+}
 
-  jobs_total = 0;
-  jobs_finished = 0;
-  last_notification_elapsed = 0;
-  size_t num = 0;
-  for (auto& im : images) {
-    size_t pixel_count = im.output_data.channels->getWidth() * im.output_data.channels->getHeight();
-    im.buf = &image_buffers[num];
-    num++;
-    if (im.output_data.func.mode == ImageMode::IMAGE_FUNC) {
-      im.render_jobs.emplace_back(0, pixel_count);
-      im.unfinished_jobs = 1;
-      jobs_total++;
+//plans images whose channels are all rendered, images becoming ready together are fused into passes
+void ImageRenderingManager::planReadyImages() {
+  TraceScope trace("plan images", "image");
+  std::lock_guard<std::mutex> lock(plan_mutex);
+  std::vector<ImageRenderPass> new_passes;
+  for (size_t i = 0; i < images.size(); ++i) {
+    if (images[i].planned) {
+      continue;
+    }
+    bool ready = true;
+    for (auto& ch_name : images[i].output_data.func.channel_names) {
+      if (pending_channels.count(std::make_pair(images[i].output_data.channels, ch_name))) {
+        ready = false;
+        break;
+      }
+    }
+    if (!ready) {
+      continue;
+    }
+    images[i].planned = true;
+    if (addToPlan(i, new_passes)) {
+      image_buffers.emplace_back(images[i].output_data.channels->getWidth(), images[i].output_data.channels->getHeight());
+      images[i].buf = &image_buffers.back();
+    }
+  }
+  if (new_passes.empty()) {
+    return;
+  }
+  std::sort(new_passes.begin(), new_passes.end());
+  size_t approx_num_jobs = num_threads * 3 + static_cast<size_t>(std::log2(total_cost));
+  size_t new_jobs = 0;
+  for (auto& pass : new_passes) {
+    size_t pixel_count = pass.channels->getWidth() * pass.channels->getHeight();
+    if (pass.mode == ImageMode::IMAGE_FUNC) {
+      pass.tiles.emplace_back(0, pixel_count);
     } else {
-      size_t ch_jobs = std::max((size_t) 1, (size_t) (im.cost / total_cost * approx_num_jobs));
+      size_t ch_jobs = std::max((size_t) 1, (size_t) (pass.cost / total_cost * approx_num_jobs));
       size_t pixels_per_job_base = pixel_count / ch_jobs;
       size_t pixels_per_job_rem = pixel_count % ch_jobs;
-      im.render_jobs.resize(ch_jobs);
-      im.unfinished_jobs = ch_jobs;
-      im.threads_on_channel = 0;
       size_t temp1 = 0;
       size_t temp2 = 0;
       for (size_t i = 0; i < ch_jobs; ++i) {
         if (i < pixels_per_job_rem) {
           temp2 += pixels_per_job_base + 1;
-          im.render_jobs[i] = std::pair<size_t, size_t>(temp1, temp2);
-          temp1 = temp2;
         } else {
           temp2 += pixels_per_job_base;
-          im.render_jobs[i] = std::pair<size_t, size_t>(temp1, temp2);
-          temp1 = temp2;
         }
+        pass.tiles.emplace_back(temp1, temp2);
+        temp1 = temp2;
       }
-      jobs_total += ch_jobs;
     }
+    startPhase(pass);
+    new_jobs += pass.tiles.size() * pass.num_phases;
   }
-#ifdef IMAGE_DEBUG
-  std::cout<<std::endl<<"Number of segments: "<<jobs_total<<" ("<<approx_num_jobs<<")\n";
-#endif
-  std::vector<std::thread> threads;
-  size_t temp_channel_num = images.size() - 1;
-  for (size_t i = 0; i < num_threads; ++i) {
-    images[temp_channel_num].threads_on_channel++;
-    threads.emplace_back(&ImageRenderingManager::threadFunction, this, temp_channel_num, i);
-    if (temp_channel_num == 0) {
-      temp_channel_num = images.size() - 1;
-    } else {
-      temp_channel_num--;
-    }
+  Trace::instant("image jobs", "image", "jobs", new_jobs);
+  {
+    std::lock_guard<std::mutex> lock2(notify_mutex);
+    jobs_total += new_jobs;
   }
-  for (size_t i = 0; i < num_threads; ++i) {
-    threads[i].join();
+  std::lock_guard<std::mutex> lock3(job_getter_mutex);
+  for (auto& pass : new_passes) {
+    passes.push_back(std::move(pass));
+  }
+  passes_remaining += new_passes.size();
+  jobs_available.notify_all();
+}
+
+void ImageRenderingManager::begin(const std::vector<std::pair<NebulabrotChannelCollection*, std::string>>& pending) {
+  execute_mutex.lock();
+  std::cout<<"Saving images:\n";
+  render_start = std::chrono::high_resolution_clock::now();
+  passes.clear();
+  image_buffers.clear();
+  image_buffers.reserve(images.size());
+  pending_channels = std::set<std::pair<NebulabrotChannelCollection*, std::string>>(pending.begin(), pending.end());
+  total_cost = 0.0;
+  for (auto& im : images) {
+    im.planned = false;
+    im.buf = nullptr;
+    total_cost += im.cost;
+  }
+  jobs_total = 0;
+  jobs_finished = 0;
+  last_notification_elapsed = 0;
+  passes_remaining = 0;
+  size_t writer_threads = num_writers > 0 ? num_writers : std::max((size_t) 1, num_threads / 4);
+  writer.reset(new ImageWriterQueue(writer_threads, writer_threads * 2, png_compression,
+                                    std::max((size_t) 1, num_threads / writer_threads)));
+  planReadyImages();
+}
+
+void ImageRenderingManager::channelReady(NebulabrotChannelCollection* channels, const std::string& name) {
+  {
+    std::lock_guard<std::mutex> lock(plan_mutex);
+    pending_channels.erase(std::make_pair(channels, name));
   }
+  planReadyImages();
+}
+
+bool ImageRenderingManager::runAvailableJob() {
+  ImageJobData job = getAJob(0, false);
+  if (job.start_index == job.end_index) {
+    return false;
+  }
+  doJob(job);
+  notifyJobCompletion(*job.pass);
+  return true;
+}
+
+void ImageRenderingManager::finish() {
+  {
+    std::lock_guard<std::mutex> lock(plan_mutex);
+    pending_channels.clear();
+  }
+  planReadyImages();
+  size_t passes_size;
+  {
+    std::lock_guard<std::mutex> lock(job_getter_mutex);
+    passes_size = std::max((size_t) 1, passes.size());
+  }
+  getThreadPool().run(num_threads, [&](size_t i) { threadFunction(passes_size - 1 - i % passes_size); });
+  writer->finish();
+  std::cout<<"Saved "<<writer->getImagesWritten()<<" images, max writer queue depth: "<<writer->getMaxDepth()
+           <<", encoding time: "<<writer->getEncodeTime()<<"\n";
+  writer.reset();
+  lookup_tables.clear();
+  image_buffers.clear();
   double time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - render_start).count();
   std::cout<<"Saving images ended in "<<time<<std::endl;
+  execute_mutex.unlock();
 }
 
-void ImageRenderingManager::threadFunction(size_t start_image, size_t thread_num) {
-  size_t previous_image = NO_CHANNEL;
-#ifdef IMAGE_DEBUG
-  std::cout<<"Thread " + std::to_string(thread_num) + " started on channel " + std::to_string(start_image) + "\n";
-#endif
+void ImageRenderingManager::execute() {
+  if (images.empty()) {
+    return;
+  }
+  begin();
+  finish();
+}
+
+void ImageRenderingManager::threadFunction(size_t start_pass) {
   while(true) {
-    ImageJobData job = getAJob(start_image);
+    ImageJobData job = getAJob(start_pass, true);
     if (job.start_index == job.end_index) {
-#ifdef IMAGE_DEBUG
-      std::cout<<"Thread " + std::to_string(thread_num) + " terminated (no more jobs)\n";
-#endif
       return;
     }
-    start_image = job.num_image;
-    if (previous_image != start_image) {
-      if (previous_image != NO_CHANNEL) {
-#ifdef IMAGE_DEBUG
-        std::cout<<"Thread " + std::to_string(thread_num) + " changed channel " + std::to_string(previous_image) + " -> " + std::to_string(start_image) + "\n";
-#endif
-      }
-    }
-#ifdef IMAGE_DEBUG
-    auto time_begin = std::chrono::high_resolution_clock::now();
-#endif
-    doJob(job, start_image);
-#ifdef IMAGE_DEBUG
-    double time = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - time_begin).count();
-    std::cout<<"Thread " + std::to_string(thread_num) + " completed job; channel: " + std::to_string(start_image)
-      + ", pixels: " + std::to_string(job.end_index - job.start_index)
-      + " in " + std::to_string(time) + "s\n";
-#endif
-    previous_image = start_image;
-    notifyJobCompletion(start_image);
+    start_pass = job.num_pass;
+    doJob(job);
+    notifyJobCompletion(*job.pass);
   }
 }
 
-void ImageRenderingManager::doJob(const ImageJobData& job, size_t image_num) {
-  size_t num_channels = job.output_data.func.channel_names.size();
-  std::vector<uint32_t*> input_channels;
-  std::vector<uint32_t> maximum_values;
-  std::vector<double> completed_iterations;
-  std::vector<double> desired_max = job.output_data.func.desired_max;
-  input_channels.reserve(num_channels);
-  maximum_values.reserve(num_channels);
-  completed_iterations.reserve(num_channels);
-  if (desired_max.empty()) {
-    desired_max.resize(job.output_data.func.channel_names.size());
-  } else if (desired_max.size() != job.output_data.func.channel_names.size()) {
-    if (!images[image_num].failed) {
-      failImage(image_num);
-      std::cout << "Error while saving image " + images[image_num].filename
-                   + ": desired_max vector has wrong size\n";
+void ImageRenderingManager::doJob(const ImageJobData& job) {
+  TraceScope trace("image job", "image", "pass", job.num_pass);
+  const ImageRenderPass& pass = *job.pass;
+  size_t num_inputs = pass.inputs.size();
+  size_t len = job.end_index - job.start_index;
+
+  if (pass.mode == ImageMode::TILED_FUNC) {
+    doTiledJob(job);
+    return;
+  }
+  if (pass.mode == ImageMode::IMAGE_FUNC) {
+    const ImageRenderChannel& im = images[pass.images[0]];
+    std::vector<uint32_t*> input_channels;
+    std::vector<uint32_t> maximum_values;
+    for (size_t index : im.inputs) {
+      input_channels.push_back(const_cast<uint32_t*>(pass.inputs[index].data) + job.start_index);
+      maximum_values.push_back(pass.inputs[index].max_value);
     }
+    im.output_data.func.ptr.whole(len, input_channels.data(), maximum_values.data(), im.buf->getData() + job.start_index);
     return;
   }
-  for (auto& ch_name : job.output_data.func.channel_names) {
-    auto it = job.output_data.channels->channels.find(ch_name);
-    if (it == job.output_data.channels->channels.end()) {
-      if (!images[image_num].failed) {
-        failImage(image_num);
-        std::cout<<"Error while saving image " + images[image_num].filename
-                   + ": no channel named " + ch_name + "\n";
+
+  //every input is read once per span and its values are shared by all images of the pass
+  const CpuKernels& kernels = getCpuKernels();
+  std::vector<double> blocks_data(num_inputs * IMAGE_SPAN_SIZE);
+  std::vector<const double*> image_blocks;
+  std::vector<double> current_values;
+  for (size_t i = 0; i < len; i += IMAGE_SPAN_SIZE) {
+    size_t span_start = job.start_index + i;
+    size_t span_len = std::min(IMAGE_SPAN_SIZE, len - i);
+    for (size_t j = 0; j < num_inputs; ++j) {
+      const ImagePassInput& in = pass.inputs[j];
+      double* block = blocks_data.data() + j * IMAGE_SPAN_SIZE;
+      const uint32_t* input = in.data + span_start;
+      const double* table = in.table;
+      double s = in.scale;
+      uint32_t max_value = in.max_value;
+      if (table) {
+        kernels.lookupCounts(input, span_len, table, max_value, in.table_shift, block);
+      } else if (!in.has_transfer) {
+        kernels.scaleCounts(input, span_len, s, block);
+      } else {
+        for (size_t k = 0; k < span_len; ++k) {
+          block[k] = in.transfer.apply(s * input[k]);
+        }
       }
-      return;
-    } else {
-      input_channels.push_back(it->second.getData() + job.start_index);
-      size_t max_value = it->second.getMaxValue();
-      if (max_value == 0) {
-        it->second.updateMaxValue();
-        max_value = it->second.getMaxValue();
+    }
+    for (size_t image_id : pass.images) {
+      const ImageRenderChannel& im = images[image_id];
+      uint32_t* output = im.buf->getData() + span_start;
+      size_t num_channels = im.inputs.size();
+      image_blocks.resize(num_channels);
+      for (size_t j = 0; j < num_channels; ++j) {
+        image_blocks[j] = blocks_data.data() + im.inputs[j] * IMAGE_SPAN_SIZE;
+      }
+      if (im.output_data.func.mode == ImageMode::SPAN_FUNC) {
+        im.output_data.func.ptr.span(span_len, image_blocks.data(), output);
+      } else {
+        current_values.resize(num_channels);
+        for (size_t k = 0; k < span_len; ++k) {
+          for (size_t j = 0; j < num_channels; ++j) {
+            current_values[j] = image_blocks[j][k];
+          }
+          output[k] = im.output_data.func.ptr.pixel(current_values.data());
+        }
       }
-      maximum_values.push_back(max_value);
-      completed_iterations.push_back(it->second.completed_iterations);
     }
   }
-  if (job.output_data.func.mode == ImageMode::IMAGE_FUNC) {
-    job.output_data.func.ptr.whole(job.end_index-job.start_index, input_channels.data(), maximum_values.data(),
-                                   images[image_num].buf->getData() + job.start_index);
-  } else {
-    std::vector<double> current_values(num_channels);
-    std::vector<double> multiplier(num_channels);
-    uint32_t* output = images[image_num].buf->getData() + job.start_index;
+}
 
-    for (size_t j = 0; j < num_channels; ++j) {
-      if (desired_max[j] <= 0.0) {
-        multiplier[j] = 1;
-      } else {
-        multiplier[j] =  desired_max[j] * completed_iterations[j] / maximum_values[j];
-      }
+const size_t MAX_LOOKUP_TABLE_SIZE = 1 << 22;
+
+bool ImageRenderingManager::LookupTableKey::operator<(const LookupTableKey& other) const {
+  return std::tie(buf, curve, param, scale, shift)
+         < std::tie(other.buf, other.curve, other.param, other.scale, other.shift);
+}
+
+//returns nullptr if the channel maximum is too big for a table
+//counts of weighted estimators are finer than a whole orbit point, so their tables may group up to weight_scale
+//counts per entry to stay below the size limit
+const double* ImageRenderingManager::getLookupTable(const NebulabrotChannelBuffer* buf, const ChannelTransfer& transfer,
+                                                    double scale, uint32_t max_value, uint32_t& shift) {
+  shift = 0;
+  size_t max_index = max_value;
+  while (max_index >= MAX_LOOKUP_TABLE_SIZE && ((uint32_t) 2 << shift) <= buf->weight_scale) {
+    shift++;
+    max_index = ((uint64_t) max_value + ((uint64_t) 1 << (shift - 1))) >> shift;
+  }
+  if (max_index >= MAX_LOOKUP_TABLE_SIZE) {
+    return nullptr;
+  }
+  LookupTableKey key = {buf, transfer.curve, transfer.param, scale, shift};
+  auto it = lookup_tables.find(key);
+  if (it == lookup_tables.end()) {
+    std::vector<double> table(max_index + 1);
+    for (size_t i = 0; i <= max_index; ++i) {
+      table[i] = transfer.apply(scale * (double) (i << shift));
     }
+    it = lookup_tables.emplace(key, std::move(table)).first;
+  }
+  return it->second.data();
+}
 
-    size_t len = job.end_index - job.start_index;
-    for (size_t i = 0; i < len; ++i) {
-      for (size_t j = 0; j < num_channels; ++j) {
-        current_values[j] = multiplier[j] * input_channels[j][i] / maximum_values[j];
+void ImageRenderingManager::doTiledJob(const ImageJobData& job) {
+  ImageRenderPass& pass = *job.pass;
+  const ImageRenderChannel& im = images[pass.images[0]];
+  const ImageFunctionData& func = im.output_data.func;
+  size_t num_channels = im.inputs.size();
+  size_t len = job.end_index - job.start_index;
+  size_t partial_size = getPartialSize(pass);
+  double* partial = partial_size > 0 ? pass.partials.data() + job.tile * partial_size : nullptr;
+  std::vector<const uint32_t*> input_channels;
+  std::vector<uint32_t> maximum_values;
+  for (size_t index : im.inputs) {
+    input_channels.push_back(pass.inputs[index].data + job.start_index);
+    maximum_values.push_back(pass.inputs[index].max_value);
+  }
+
+  size_t bins = func.histogram_bins;
+  if (bins > 0 && pass.phase == 0) {
+    for (size_t j = 0; j < num_channels; ++j) {
+      double* hist = partial + j * bins;
+      uint64_t divisor = (uint64_t) maximum_values[j] + 1;
+      for (size_t i = 0; i < len; ++i) {
+        hist[std::min(bins - 1, (size_t) (input_channels[j][i] * bins / divisor))] += 1.0;
       }
-      output[i] = job.output_data.func.ptr.pixel(current_values.data());
     }
+    return;
   }
+
+  std::vector<const uint64_t*> histograms;
+  for (auto& hist : pass.histograms) {
+    histograms.push_back(hist.data());
+  }
+  ImageTileInfo info;
+  info.start_index = job.start_index;
+  info.count = len;
+  info.width = pass.channels->getWidth();
+  info.height = pass.channels->getHeight();
+  info.num_channels = num_channels;
+  info.max_values = maximum_values.data();
+  info.histograms = histograms.empty() ? nullptr : histograms.data();
+  info.histogram_bins = bins;
+  info.phase = pass.phase - (bins > 0 ? 1 : 0);
+  info.reduction = info.phase > 0 ? pass.reduction.data() : nullptr;
+  info.partial = partial;
+  func.ptr.tiled(info, input_channels.data(), im.buf->getData() + job.start_index);
 }
 
-ImageJobData ImageRenderingManager::getAJob(size_t preferred_image) {
+size_t ImageRenderingManager::getPartialSize(const ImageRenderPass& pass) const {
+  if (pass.mode != ImageMode::TILED_FUNC || pass.phase + 1 >= pass.num_phases) {
+    return 0;
+  }
+  const ImageFunctionData& func = images[pass.images[0]].output_data.func;
+  if (func.histogram_bins > 0 && pass.phase == 0) {
+    return func.channel_names.size() * func.histogram_bins;
+  }
+  return func.reduction_size;
+}
+
+//called with job_getter_mutex held or before workers start
+void ImageRenderingManager::startPhase(ImageRenderPass& pass) {
+  pass.render_jobs.resize(pass.tiles.size());
+  for (size_t i = 0; i < pass.tiles.size(); ++i) {
+    pass.render_jobs[i] = i;
+  }
+  pass.unfinished_jobs = pass.tiles.size();
+  pass.partials.assign(pass.tiles.size() * getPartialSize(pass), 0.0);
+}
+
+//sums partial results of all tiles, no jobs of the pass are running at that point
+void ImageRenderingManager::finishPhase(ImageRenderPass& pass) {
+  TraceScope trace("finish phase", "image", "phase", pass.phase);
+  size_t partial_size = getPartialSize(pass);
+  pass.reduction.assign(partial_size, 0.0);
+  for (size_t t = 0; t < pass.tiles.size(); ++t) {
+    const double* partial = pass.partials.data() + t * partial_size;
+    for (size_t k = 0; k < partial_size; ++k) {
+      pass.reduction[k] += partial[k];
+    }
+  }
+  const ImageFunctionData& func = images[pass.images[0]].output_data.func;
+  if (func.histogram_bins > 0 && pass.phase == 0) {
+    for (size_t j = 0; j < pass.histograms.size(); ++j) {
+      pass.histograms[j].assign(pass.reduction.begin() + j * func.histogram_bins,
+                                pass.reduction.begin() + (j + 1) * func.histogram_bins);
+    }
+    pass.reduction.clear();
+  }
   std::lock_guard<std::mutex> lock(job_getter_mutex);
+  pass.phase++;
+  startPhase(pass);
+  jobs_available.notify_all();
+}
+
+//waits while other threads may still advance passes to further phases, unless wait is false
+ImageJobData ImageRenderingManager::getAJob(size_t preferred_pass, bool wait) {
+  TraceScope trace("get job", "image");
+  std::unique_lock<std::mutex> lock(job_getter_mutex);
   ImageJobData result;
-  bool found = false;
-  size_t images_size = images.size();
-  for (size_t i = 0; i < images_size; ++i) {
-    size_t vec_size = images[preferred_image].render_jobs.size();
-    if (vec_size > 0) {
-      auto p = images[preferred_image].render_jobs[vec_size-1];
-      result.start_index = p.first;
-      result.end_index = p.second;
-      images[preferred_image].render_jobs.pop_back();
-      found = true;
-      break;
+  while (true) {
+    size_t passes_size = passes.size();
+    preferred_pass = std::min(preferred_pass, passes_size - 1);
+    for (size_t i = 0; i < passes_size; ++i) {
+      size_t vec_size = passes[preferred_pass].render_jobs.size();
+      if (vec_size > 0) {
+        size_t tile = passes[preferred_pass].render_jobs[vec_size-1];
+        result.start_index = passes[preferred_pass].tiles[tile].first;
+        result.end_index = passes[preferred_pass].tiles[tile].second;
+        result.tile = tile;
+        result.num_pass = preferred_pass;
+        result.pass = &passes[preferred_pass];
+        passes[preferred_pass].render_jobs.pop_back();
+        return result;
+      }
+      if (preferred_pass > 0) {
+        preferred_pass--;
+      } else {
+        preferred_pass = passes_size - 1;
+      }
     }
-    if (preferred_image > 0) {
-      preferred_image--;
-    } else {
-      preferred_image = images_size - 1;
+    if (passes_remaining == 0 || !wait) {
+      return result;
     }
+    jobs_available.wait(lock);
   }
-  if (!found) {
-    return result;
-  }
-  result.output_data = images[preferred_image].output_data;
-  result.num_image = preferred_image;
-  return result;
 }
 
-void ImageRenderingManager::notifyJobCompletion(size_t image_id) {
+void ImageRenderingManager::notifyJobCompletion(ImageRenderPass& pass) {
   notify_mutex.lock();
-  images[image_id].unfinished_jobs--;
+  pass.unfinished_jobs--;
   jobs_finished++;
   double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(
       std::chrono::high_resolution_clock::now() - render_start).count();
@@ -760,17 +1778,23 @@ void ImageRenderingManager::notifyJobCompletion(size_t image_id) {
                 << ", estimated remaining time: " << estimated << "\n";
     }
   }
-  if (images[image_id].unfinished_jobs == 0 && !images[image_id].failed) {
-    notify_mutex.unlock();
-    images[image_id].buf->saveFile(images[image_id].filename);
-  } else {
-    notify_mutex.unlock();
+  bool phase_finished = pass.unfinished_jobs == 0;
+  notify_mutex.unlock();
+  if (!phase_finished) {
+    return;
+  }
+  if (pass.phase + 1 < pass.num_phases) {
+    finishPhase(pass);
+    return;
+  }
+  for (size_t image_id : pass.images) {
+    if (save_images) {
+      writer->push(images[image_id].buf, images[image_id].filename);
+    }
   }
-}
-
-void ImageRenderingManager::failImage(size_t image_id) {
   std::lock_guard<std::mutex> lock(job_getter_mutex);
-  std::lock_guard<std::mutex> lock2(notify_mutex);
-  images[image_id].failed = true;
-  images[image_id].render_jobs.clear();
+  passes_remaining--;
+  if (passes_remaining == 0) {
+    jobs_available.notify_all();
+  }
 }
@@ -1,14 +1,26 @@
 #ifndef LIBNEBULABROTGEN_H
 #define LIBNEBULABROTGEN_H
 
-#include "stb_image_write.h"
+#include "pngwriter.h"
+#include "threadpool.h"
+#include "numa.h"
+#include "trace.h"
+#include "perfcounters.h"
+#include "kernels.h"
 #include <vector>
 #include <map>
+#include <set>
 #include <iostream>
 #include <fstream>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
 #include <memory>
 #include <complex>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
 
 void logMessage(const std::string& message);
 
@@ -16,16 +28,24 @@ class NebulabrotChannelBuffer {
 public:
   NebulabrotChannelBuffer(size_t width, size_t height);
   NebulabrotChannelBuffer(const NebulabrotChannelBuffer& other);
+  NebulabrotChannelBuffer(NebulabrotChannelBuffer&& other) noexcept;
   NebulabrotChannelBuffer& operator=(const NebulabrotChannelBuffer& other);
 
   void clear();
   uint32_t* getData();
+  size_t getSize() const;
   uint32_t getMaxValue() const;
+  //false if the sizes or (unless this one is empty) the weight scales differ
   bool mergeWith(const NebulabrotChannelBuffer& other);
   bool toStream(std::ostream& os);
   bool fromStream(std::istream& is);
+  bool headerToStream(std::ostream& os);
+  //weight_scale: false for files saved before the header recorded it, their scale is 1
+  bool headerFromStream(std::istream& is, bool weight_scale = true);
   void updateMaxValue();
   size_t completed_iterations;
+  //counts an orbit point adds per accepted orbit, see estimatorWeightScale
+  uint32_t weight_scale;
 private:
   std::vector<uint32_t> data;
   uint32_t max_value;
@@ -35,8 +55,12 @@ private:
 class NebulabrotChannelCollection {
 public:
   NebulabrotChannelCollection(size_t width, size_t height);
-  bool loadFile(const std::string& filename);
-  bool saveFile(const std::string& filename);
+  //num_threads: amount of threads transferring channel data in chunks, 0 means hardware concurrency
+  bool loadFile(const std::string& filename, size_t num_threads = 0);
+  bool saveFile(const std::string& filename, size_t num_threads = 0);
+  //saves every channel as prefix_name.npy with shape (height, width), either raw uint32 counts
+  //or float32 values normalized by channel maximum
+  bool exportNpy(const std::string& prefix, bool normalized = false, size_t num_threads = 0);
   void merge(const NebulabrotChannelCollection& other);
 
   std::map<std::string, NebulabrotChannelBuffer> channels;
@@ -50,31 +74,52 @@ private:
 
 //typedef void(*InnerFunc)(double*, double*, double, double);
 
-typedef void(*InnerFunc)(std::complex<double>&, std::complex<double>);
-
-struct InnerFunctionData {
-  InnerFunctionData(InnerFunc ptr, double cost = 1.0);
-  InnerFunc ptr;
-  double cost;
-};
-
 struct NebulabrotIterationData {
-  NebulabrotIterationData(size_t inner_iterations, size_t renderer_iterations, const InnerFunctionData& func);
+  //precision: auto selects it from the view with selectPrecision, others force it if func has that variant
+  //estimator: expected gives SPLAT_WEIGHT_SCALE times larger counts, which shouldn't be merged with accepted ones
+  NebulabrotIterationData(size_t inner_iterations, size_t renderer_iterations, const InnerFunctionData& func,
+                          RendererPrecision precision = PRECISION_AUTO, SplatEstimator estimator = SPLAT_ACCEPTED);
   double getCost() const;
   size_t inner_iterations;
   size_t renderer_iterations;
   InnerFunctionData func;
+  RendererPrecision precision;
+  SplatEstimator estimator;
+  //chains and proposals of the renderers, a job runs renderer_iterations proposals on each chain
+  MutationParameters mutation;
 };
 
+//lowest precision whose rounding error keeps orbits within a fraction of a pixel of the exact ones: a step of an
+//orbit and its mapping to a pixel add about PRECISION_ERROR_STEPS unit roundoffs of the largest on-screen magnitude,
+//which has to stay below 1 / PRECISION_PIXEL_FRACTION of a pixel; only precisions func has variants for are chosen
+//(double if it isn't enough and there's no double-double variant, perturbation instead of double-double if there's
+//a perturbation variant too)
+RendererPrecision selectPrecision(const InnerFunctionData& func, double xmid, double ymid, double factor,
+                                  size_t width, size_t height);
+const char* precisionName(RendererPrecision precision);
+const char* estimatorName(SplatEstimator estimator);
+//SPLAT_WEIGHT_SCALE for expected, 1 for accepted; images are normalized by it and channels with different scales
+//aren't merged
+uint32_t estimatorWeightScale(SplatEstimator estimator);
+const double PRECISION_ERROR_STEPS = 8;
+const double PRECISION_PIXEL_FRACTION = 16;
+
 struct NebulabrotRenderChannel {
   NebulabrotRenderChannel(const NebulabrotIterationData& data, const std::string& name);
   double cost;
   std::string name;
   NebulabrotIterationData data;
   NebulabrotChannelBuffer* buf;
+  //with more than one numa node and a pinned pool, threads merge into a buffer of their node first, allocated by
+  //the first of them
+  std::vector<std::unique_ptr<NebulabrotChannelBuffer>> node_bufs;
   size_t unfinished_jobs;
   size_t threads_on_channel;
   std::vector<size_t> iteration_jobs;
+  //set under job_getter_mutex when a job threw, its remaining jobs are dropped
+  bool failed;
+  //resolved when execution starts, never auto
+  RendererPrecision precision;
   inline bool operator<(const NebulabrotRenderChannel& other) const;
 };
 
@@ -83,39 +128,129 @@ struct IterJobData {
   NebulabrotIterationData iter_data;
   NebulabrotChannelBuffer* buf;
   size_t num_channel;
+  //index among the jobs of the channel
+  size_t job_index;
 };
 
+//times are in seconds, summed over all threads working on the channel
+struct RenderChannelMetrics {
+  std::string name;
+  size_t inner_iterations = 0;
+  RendererPrecision precision = PRECISION_DOUBLE;
+  SplatEstimator estimator = SPLAT_ACCEPTED;
+  uint64_t proposals = 0;
+  uint64_t accepted = 0;
+  uint64_t rejected_non_escaping = 0;
+  uint64_t rejected_off_screen = 0;
+  uint64_t glitches = 0;
+  uint64_t recomputed = 0;
+  //configured parameters, sums of the tuned ones over the renderers (or jobs of deterministic renders) tuning them
+  MutationParameters mutation;
+  double tuned_random_fraction = 0;
+  double tuned_move_min = 0;
+  double tuned_move_max = 0;
+  size_t tunings = 0;
+  double render_time = 0;
+  double seed_time = 0;
+  double merge_time = 0;
+  //seconds since the start of the run, negative until it happens
+  double start = -1;
+  double finish = -1;
+};
+
+struct RenderThreadMetrics {
+  size_t jobs = 0;
+  uint64_t proposals = 0;
+  double render_time = 0;
+  double seed_time = 0;
+  double merge_time = 0;
+  //image jobs run between iteration jobs in pipelined execution
+  double image_time = 0;
+  double start = -1;
+  double finish = -1;
+  //hardware counters around render jobs (orbits and splats), seed searches (orbits only), merges and image jobs
+  bool perf_available = false;
+  PerfValues perf_render;
+  PerfValues perf_seed;
+  PerfValues perf_merge;
+  PerfValues perf_image;
+};
+
+class ImageRenderingManager;
+
 class NebulabrotRenderingManager {
 public:
-  NebulabrotRenderingManager(double xmid, double ymid, double factor,
+  //the centre in double-double for views beyond double precision
+  NebulabrotRenderingManager(const DoubleDouble& xmid, const DoubleDouble& ymid, double factor,
                              double random_radius, double norm_limit,
                              size_t width, size_t height, size_t num_threads);
   bool add(const std::string& name, const NebulabrotIterationData& iteration_data);
   NebulabrotChannelCollection execute();
+  //renders into the given collection, adding to channels that already exist there
+  //if images are given, their outputs are computed as soon as the channels they use are finished
+  //false if a channel failed: its counts and iterations then hold the jobs finished before, without the failed one
+  bool execute(NebulabrotChannelCollection& result, ImageRenderingManager* images);
+  //pool running the rendering threads, nullptr means the shared pool
+  void setThreadPool(ThreadPool* pool);
+  //metrics of the current or the last run, can be called from other threads during execute
+  std::string getMetricsJson() const;
+  //metrics are written to the file at the end of every execute, empty string disables
+  void setMetricsFile(const std::string& filename);
+  //collects hardware performance counters per thread into the metrics, if the system permits it
+  void setPerfCounters(bool enabled);
+  //source of the sampler's random numbers, xoshiro by default
+  void setRandomGenerator(RandomGenerator generator);
+  //deterministic renders give bit-identical results for the same seed regardless of the number of threads
+  //(with the same build and kernel set) and regardless of the other channels: every channel is split into num_jobs
+  //jobs and every job renders one independent chain seeded by philox keyed on (seed, channel name, job), so it costs
+  //a seed search per job, the generator set by setRandomGenerator is not used
+  //chains start biased towards their initial points, num_jobs chains give the same bias as a normal render
+  //on num_jobs / 16 threads
+  void setDeterministic(bool enabled, uint64_t seed = 0, size_t num_jobs = 64);
 
 private:
+  ThreadPool& getThreadPool();
+  void recordJob(size_t thread_num, size_t channel_id, const RendererStats& stats, double render_time);
+  void recordMutation(size_t channel_id, const MutationParameters& tuned);
   void threadFunction(size_t start_channel, size_t thread_num);
   IterJobData getAJob(size_t preferred_channel);
   void notifyJobCompletion(size_t channel_id);
-  void leaveChannel(size_t previous_channel, size_t new_channel, size_t thread_num, const NebulabrotChannelBuffer& buf);
+  void failChannel(size_t channel_id, const std::string& error);
+  void leaveChannel(size_t previous_channel, size_t new_channel, const NebulabrotChannelBuffer& buf);
 
   std::vector<NebulabrotRenderChannel> channels;
   std::mutex execute_mutex;
   std::mutex job_getter_mutex;
   std::mutex notify_mutex;
   std::mutex leave_mutex;
+  std::unique_ptr<std::mutex[]> node_mutexes;
+  mutable std::mutex metrics_mutex;
+  std::vector<RenderChannelMetrics> channel_metrics;
+  std::vector<RenderThreadMetrics> thread_metrics;
+  std::string metrics_file;
+  bool perf_counters = false;
+  RandomGenerator random_generator = RANDOM_XOSHIRO;
+  bool deterministic = false;
+  uint64_t deterministic_seed = 0;
+  size_t deterministic_jobs = 64;
+  bool running = false;
+  double run_time = 0;
   std::chrono::time_point<std::chrono::high_resolution_clock> render_start;
   int last_notification_elapsed;
   size_t jobs_total;
   size_t jobs_finished;
-  double xmid;
-  double ymid;
+  size_t num_nodes;
+  DoubleDouble xmid;
+  DoubleDouble ymid;
   double factor;
   double random_radius;
   double norm_limit;
   size_t width;
   size_t height;
   size_t num_threads;
+  ImageRenderingManager* image_manager;
+  NebulabrotChannelCollection* result_collection;
+  ThreadPool* pool;
 };
 
 class ImageColorBuffer {
@@ -127,7 +262,7 @@ public:
   ImageColorBuffer& operator=(const ImageColorBuffer& other) = delete;
   ~ImageColorBuffer();
   inline uint32_t* getData() { return data; }
-  bool saveFile(const std::string& filename);
+  bool saveFile(const std::string& filename, PngCompression compression = PNG_DEFAULT, size_t num_threads = 0);
 
 private:
   size_t width;
@@ -139,27 +274,133 @@ private:
 //arg1: array of values corresponding to channels (val/max)
 typedef uint32_t (*ImagePixelFunc)(double*);
 
+//arg1: amount of pixels
+//arg2: array of pointers to blocks of values for each channel (val/max), IMAGE_SPAN_SIZE values at most
+//arg3: result pointer to RGBA
+typedef void (*ImageSpanFunc)(size_t, const double* const*, uint32_t*);
+
 //arg1: amount of pixels
 //arg2: array of pointers to iterations results for each channel
 //arg3: array of maximum values for each channel
 //arg4: result pointer to RGBA
 typedef void (*WholeImageFunc)(size_t, uint32_t**, uint32_t*, uint32_t*);
 
+//description of a tile given to tiled image functions
+struct ImageTileInfo {
+  size_t start_index;
+  size_t count;
+  size_t width;
+  size_t height;
+  size_t num_channels;
+  //maximum values for each channel
+  const uint32_t* max_values;
+  //histograms of each channel if requested, value v falls into bin v * histogram_bins / (max + 1)
+  const uint64_t* const* histograms;
+  size_t histogram_bins;
+  //phases before the last one only compute partial results, which are summed over all tiles and passed to the next phase
+  size_t phase;
+  //sums of partial results of the previous phase, nullptr in the first phase
+  const double* reduction;
+  //zeroed partial result of this tile, nullptr in the last phase
+  double* partial;
+};
+
+//arg1: tile description
+//arg2: array of pointers to iterations results for each channel, starting at the tile
+//arg3: result pointer to RGBA of the tile, unused in phases other than the last
+typedef void (*TiledImageFunc)(const ImageTileInfo&, const uint32_t* const*, uint32_t*);
+
+const size_t IMAGE_SPAN_SIZE = 256;
+
 enum ImageMode {
-  PIXEL_FUNC = 0, IMAGE_FUNC = 1
+  PIXEL_FUNC = 0, SPAN_FUNC = 1, TILED_FUNC = 2, IMAGE_FUNC = 3
+};
+
+enum TransferCurve {
+  CURVE_LINEAR = 0, CURVE_SQRT = 1, CURVE_POW = 2, CURVE_LOG = 3
+};
+
+//curve applied to a normalized channel value, param is the exponent for CURVE_POW
+//and the strength for CURVE_LOG (log(1 + param * value) / log(1 + param))
+struct ChannelTransfer {
+  ChannelTransfer(TransferCurve curve = CURVE_LINEAR, double param = 1.0);
+  double apply(double value) const;
+  TransferCurve curve;
+  double param;
 };
 
 struct ImageFunctionData {
-  union ImageFunc { ImagePixelFunc pixel; WholeImageFunc whole; };
+  union ImageFunc { ImagePixelFunc pixel; ImageSpanFunc span; TiledImageFunc tiled; WholeImageFunc whole; };
   ImageFunctionData(ImagePixelFunc ptr, const std::vector<std::string>& channel_names, const std::vector<double>& desired_max, double cost = 1.0);
+  ImageFunctionData(ImageSpanFunc ptr, const std::vector<std::string>& channel_names, const std::vector<double>& desired_max, double cost = 1.0);
+  ImageFunctionData(TiledImageFunc ptr, const std::vector<std::string>& channel_names, size_t phases = 1,
+                    size_t reduction_size = 0, size_t histogram_bins = 0, double cost = 1.0);
   ImageFunctionData(WholeImageFunc ptr, const std::vector<std::string>& channel_names, const std::vector<double>& desired_max, double cost = 1.0);
   ImageFunc ptr;
   ImageMode mode;
   std::vector<std::string> channel_names;
   std::vector<double> desired_max;
+  //optional curves for each channel, values are precomputed for every count into lookup tables shared between images
+  std::vector<ChannelTransfer> transfers;
+  //tiled functions only: number of phases, size of partial results of phases and number of histogram bins
+  size_t phases;
+  size_t reduction_size;
+  size_t histogram_bins;
   double cost;
 };
 
+inline double transferLinear(double value) { return value; }
+inline double transferSqrt(double value) { return std::sqrt(value); }
+
+inline uint32_t packColor(double r, double g, double b) {
+  uint32_t ri = (uint32_t) (255.0 * std::min(1.0, std::max(0.0, r)));
+  uint32_t gi = (uint32_t) (255.0 * std::min(1.0, std::max(0.0, g)));
+  uint32_t bi = (uint32_t) (255.0 * std::min(1.0, std::max(0.0, b)));
+  return ri | (gi << 8) | (bi << 16) | 0xff000000;
+}
+
+//built-in span function: grayscale image of the first channel
+template<double (*transfer)(double)>
+void spanMonochrome(size_t count, const double* const* values, uint32_t* output) {
+  const double* v = values[0];
+  for (size_t i = 0; i < count; ++i) {
+    double val = transfer(v[i]);
+    output[i] = packColor(val, val, val);
+  }
+}
+
+//built-in span function: channels ordered from the lowest iterations are spread from blue through green to red,
+//weights of each color are normalized so that it saturates when all channels saturate
+template<size_t num_channels, double (*transfer)(double)>
+void spanNebulabrot(size_t count, const double* const* values, uint32_t* output) {
+  double weights[3][num_channels];
+  double sums[3] = {0, 0, 0};
+  for (size_t j = 0; j < num_channels; ++j) {
+    double t = num_channels > 1 ? (double) j / (num_channels - 1) : 0.5;
+    weights[0][j] = std::max(0.0, 2.0 * t - 1.0);
+    weights[1][j] = 1.0 - std::abs(2.0 * t - 1.0);
+    weights[2][j] = std::max(0.0, 1.0 - 2.0 * t);
+    for (size_t c = 0; c < 3; ++c) {
+      sums[c] += weights[c][j];
+    }
+  }
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t j = 0; j < num_channels; ++j) {
+      weights[c][j] = sums[c] > 0 ? weights[c][j] / sums[c] : 0;
+    }
+  }
+  for (size_t i = 0; i < count; ++i) {
+    double color[3] = {0, 0, 0};
+    for (size_t j = 0; j < num_channels; ++j) {
+      double val = transfer(values[j][i]);
+      for (size_t c = 0; c < 3; ++c) {
+        color[c] += weights[c][j] * val;
+      }
+    }
+    output[i] = packColor(color[0], color[1], color[2]);
+  }
+}
+
 struct ImageOutputData {
   ImageOutputData(const ImageFunctionData&, NebulabrotChannelCollection* channels);
   double getCost() const;
@@ -173,43 +414,156 @@ struct ImageRenderChannel {
   std::string filename;
   ImageOutputData output_data;
   ImageColorBuffer* buf;
-  bool failed;
+  //indices of pass inputs corresponding to channel names
+  std::vector<size_t> inputs;
+  bool planned;
+};
+
+//normalized channel values as seen by image functions, shared between images of a pass
+struct ImagePassInput {
+  bool sameAs(const ImagePassInput& other) const;
+  const NebulabrotChannelBuffer* buf;
+  const uint32_t* data;
+  uint32_t max_value;
+  double scale;
+  bool has_transfer;
+  ChannelTransfer transfer;
+  const double* table;
+  //the table has an entry per 2^table_shift counts
+  uint32_t table_shift;
+};
+
+//images computed together: either all pixel and span images of a collection, reading each input once per job
+//and writing all of their outputs, or a single tiled or whole image function
+struct ImageRenderPass {
+  ImageRenderPass(ImageMode mode, NebulabrotChannelCollection* channels);
+  ImageMode mode;
+  NebulabrotChannelCollection* channels;
+  double cost;
+  std::vector<size_t> images;
+  std::vector<ImagePassInput> inputs;
   size_t unfinished_jobs;
-  size_t threads_on_channel;
-  std::vector<std::pair<size_t, size_t>> render_jobs;
-  inline bool operator<(const ImageRenderChannel& other) const;
+  std::vector<std::pair<size_t, size_t>> tiles;
+  //indices of tiles not yet taken in the current phase
+  std::vector<size_t> render_jobs;
+  //tiled functions: histogram computation is an additional phase before the function's own phases
+  size_t phase;
+  size_t num_phases;
+  std::vector<double> partials;
+  std::vector<double> reduction;
+  std::vector<std::vector<uint64_t>> histograms;
+  inline bool operator<(const ImageRenderPass& other) const;
 };
 
 struct ImageJobData {
   ImageJobData();
-  ImageOutputData output_data;
   size_t start_index;
   size_t end_index;
-  size_t num_image;
+  size_t tile;
+  size_t num_pass;
+  //resolved by getAJob under job_getter_mutex, passes is never indexed without it
+  ImageRenderPass* pass;
+};
+
+//bounded queue of finished images encoded and saved by dedicated writer threads
+class ImageWriterQueue {
+public:
+  ImageWriterQueue(size_t num_writers, size_t capacity, PngCompression compression, size_t encode_threads);
+  ~ImageWriterQueue();
+  //blocks while the queue is full
+  void push(ImageColorBuffer* buf, const std::string& filename);
+  //waits until all queued images are saved
+  void finish();
+  size_t getMaxDepth() const;
+  double getEncodeTime() const;
+  size_t getImagesWritten() const;
+
+private:
+  void writerFunction(size_t writer_num);
+
+  std::deque<std::pair<ImageColorBuffer*, std::string>> queue;
+  std::vector<std::thread> writers;
+  mutable std::mutex queue_mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  size_t capacity;
+  PngCompression compression;
+  size_t encode_threads;
+  bool finishing;
+  size_t max_depth;
+  double encode_time;
+  size_t images_written;
 };
 
 class ImageRenderingManager {
 public:
   explicit ImageRenderingManager(size_t threads);
   bool add(const std::string& filename, const ImageOutputData& image_data);
+  void setPngCompression(PngCompression compression);
+  //num_writers: threads encoding and saving finished images, 0 means a quarter of rendering threads
+  void setWriterThreads(size_t num_writers);
+  //pool running the image threads, nullptr means the shared pool
+  void setThreadPool(ThreadPool* pool);
+  //when disabled, images are computed but not encoded or written (benchmarks)
+  void setSaveImages(bool save);
   void execute();
 
+  //pipelined execution, images depending on pending channels are planned once all their channels are ready,
+  //jobs of planned images can be run by other threads in the meantime, finish computes and saves the rest
+  void begin(const std::vector<std::pair<NebulabrotChannelCollection*, std::string>>& pending = {});
+  void channelReady(NebulabrotChannelCollection* channels, const std::string& name);
+  //runs a single job if any is available, doesn't wait
+  bool runAvailableJob();
+  void finish();
+
 private:
-  void threadFunction(size_t start_image, size_t thread_num);
-  ImageJobData getAJob(size_t preferred_image);
-  void notifyJobCompletion(size_t image_id);
-  void failImage(size_t image_id);
-  void doJob(const ImageJobData& job, size_t image_num);
+  ThreadPool& getThreadPool();
+  void planReadyImages();
+  bool addToPlan(size_t image_id, std::vector<ImageRenderPass>& new_passes);
+  void threadFunction(size_t start_pass);
+  ImageJobData getAJob(size_t preferred_pass, bool wait);
+  void notifyJobCompletion(ImageRenderPass& pass);
+  void startPhase(ImageRenderPass& pass);
+  void finishPhase(ImageRenderPass& pass);
+  size_t getPartialSize(const ImageRenderPass& pass) const;
+  void doJob(const ImageJobData& job);
+  void doTiledJob(const ImageJobData& job);
+  const double* getLookupTable(const NebulabrotChannelBuffer* buf, const ChannelTransfer& transfer,
+                               double scale, uint32_t max_value, uint32_t& shift);
+
+  struct LookupTableKey {
+    const NebulabrotChannelBuffer* buf;
+    int curve;
+    double param;
+    double scale;
+    uint32_t shift;
+    bool operator<(const LookupTableKey& other) const;
+  };
 
   std::vector<ImageRenderChannel> images;
+  //appended by planReadyImages while workers run, so only accessed under job_getter_mutex; the deque keeps
+  //references to its elements valid, jobs carry a pointer to their pass
+  std::deque<ImageRenderPass> passes;
+  std::vector<ImageColorBuffer> image_buffers;
+  std::set<std::pair<NebulabrotChannelCollection*, std::string>> pending_channels;
+  std::map<LookupTableKey, std::vector<double>> lookup_tables;
+  double total_cost;
+  std::mutex plan_mutex;
   std::mutex execute_mutex;
   std::mutex job_getter_mutex;
+  std::condition_variable jobs_available;
   std::mutex notify_mutex;
   std::chrono::time_point<std::chrono::high_resolution_clock> render_start;
   int last_notification_elapsed;
   size_t jobs_total;
   size_t jobs_finished;
+  size_t passes_remaining;
   size_t num_threads;
+  size_t num_writers;
+  PngCompression png_compression;
+  ThreadPool* pool;
+  bool save_images = true;
+  std::unique_ptr<ImageWriterQueue> writer;
 };
 
 #endif
@@ -5,16 +5,32 @@
 #include <cmath>
 #include <fstream>
 #include <complex>
+#include <sstream>
+#include <string>
 #include "libnebulabrotgen.h"
 
-const double xmid = 0;
-const double ymid = 0;
-const double size = 8;
-const size_t width = 1920;
-const size_t height = 1080;
-const size_t iterations = 1000000;
-const double random_radius = 32;
-const double norm_limit = 256;
+//defaults of the scene, each can be overridden from the command line
+DoubleDouble xmid = 0;
+DoubleDouble ymid = 0;
+double size = 8;
+size_t width = 1920;
+size_t height = 1080;
+size_t iterations = 1000000;
+double random_radius = 32;
+double norm_limit = 256;
+size_t threads = std::thread::hardware_concurrency();
+std::string output_dir = ".";
+std::string load_file;
+std::string save_file;
+std::string metrics_file;
+std::string trace_file;
+bool perf_counters = false;
+bool pin_threads = false;
+bool deterministic = false;
+uint64_t seed = 0;
+RendererPrecision precision = PRECISION_AUTO;
+SplatEstimator estimator = SPLAT_ACCEPTED;
+MutationParameters mutation;
 
 inline double limit(double value) {
   return std::min(1.0, std::max(0.0, value));
@@ -26,27 +42,27 @@ inline double mapv(double value, double in_diff, double out_diff) {
 
 typedef std::complex<double> complex;
 
-void func(std::complex<double>& z, std::complex<double> c) {
+//instantiated for every precision the renderer can select
+template<typename real_t>
+void func(std::complex<real_t>& z, std::complex<real_t> c) {
   z = z * z + c;
 }
 
-uint32_t img_func(double* values) {
-  uint8_t result[4];
-  result[0] = (uint8_t) (255.0 * limit(values[3] * 0.375 + sqrt(values[4] * 0.375) + sqrt(values[5]) * 0.5 + sqrt(values[6]) * 0.675));
-  result[1] = (uint8_t) (255.0 * limit(values[1] * 0.375 + sqrt(values[2]) * 0.375 + sqrt(values[3]) * 0.5 + sqrt(values[4]) * 0.375 + values[5] * 0.375));
-  result[2] = (uint8_t) (255.0 * limit(sqrt(values[0]) * 0.625 + sqrt(values[1]) * 0.5 + sqrt(values[2]) * 0.375 + values[3] * 0.375));
-  result[3] = 0xff;
-  return * (uint32_t*) result;
+//func for deep zooms, as offsets from a reference orbit
+void funcPerturbation(std::complex<double>& dz, std::complex<double> ref, std::complex<double> dc) {
+  dz = (2.0 * ref + dz) * dz + dc;
 }
 
-uint32_t img_monochrome(double* values) {
-  uint8_t result[4];
-  double val = sqrt(values[0]);
-  result[0] = (uint8_t) (255.0 * val);
-  result[1] = (uint8_t) (255.0 * val);
-  result[2] = (uint8_t) (255.0 * val);
-  result[3] = 0xff;
-  return * (uint32_t*) result;
+//channels: sqrt of i1..i7, then linear i2, i4, i6
+void img_func(size_t count, const double* const* values, uint32_t* output) {
+  const double* const* s = values;
+  const double* const* l = values + 7;
+  for (size_t i = 0; i < count; ++i) {
+    double r = l[1][i] * 0.375 + s[4][i] * 0.6123724356957945 + s[5][i] * 0.5 + s[6][i] * 0.675;
+    double g = l[0][i] * 0.375 + s[2][i] * 0.375 + s[3][i] * 0.5 + s[4][i] * 0.375 + l[2][i] * 0.375;
+    double b = s[0][i] * 0.625 + s[1][i] * 0.5 + s[2][i] * 0.375 + l[1][i] * 0.375;
+    output[i] = packColor(r, g, b);
+  }
 }
 
 /*
@@ -77,19 +93,149 @@ void temp_func(std::complex<double>& x, std::complex<double> c) {
 
 //const std::string func_name = "z^2 + c at 0, f=4";
 
-typedef std::array<std::array<uint32_t, width>, height> arrwh;
+void func_tiled(const ImageTileInfo& tile, const uint32_t* const* pixels, uint32_t* result) {
+  for (size_t i = 0; i < tile.count; ++i) {
+    double val = (double) pixels[0][i] / tile.max_values[0];
+    result[i] = packColor(val, val, val);
+  }
+}
+
+void printUsage(const char* program) {
+  std::cout<<"usage: "<<program<<" [options]\n"
+           <<"  --center x y          centre of the image (default "<<(double) xmid<<" "<<(double) ymid<<")\n"
+           <<"  --size s              width of the view on the complex plane (default "<<size<<")\n"
+           <<"  --width w             image width (default "<<width<<")\n"
+           <<"  --height h            image height (default "<<height<<")\n"
+           <<"  --iterations n        orbit attempts per channel (default "<<iterations<<")\n"
+           <<"  --random-radius r     radius of random starting points (default "<<random_radius<<")\n"
+           <<"  --norm-limit l        escape radius (default "<<norm_limit<<")\n"
+           <<"  --threads n           worker threads (default "<<threads<<")\n"
+           <<"  --pin                 bind worker threads to cpus of the affinity mask\n"
+           <<"  --seed n              deterministic render, identical for any number of threads\n"
+           <<"  --precision p         auto, float, double, double-double or perturbation (default auto)\n"
+           <<"  --estimator e         accepted or expected (every proposal weighted, default accepted)\n"
+           <<"  --chains n            metropolis chains per thread (default "<<mutation.chains<<")\n"
+           <<"  --random-fraction f   share of random proposals, the rest move (default "<<mutation.random_fraction<<")\n"
+           <<"  --move-radius a b     radii of moves relative to the size (default "<<mutation.move_min<<" "
+           <<mutation.move_max<<")\n"
+           <<"  --adaptive            tune the proposals in a burn-in of each chain, which then count their states\n"
+           <<"  --output dir          directory of the saved images (default "<<output_dir<<")\n"
+           <<"  --load file           add the results to a raw file saved before\n"
+           <<"  --save file           save the raw results after rendering\n"
+           <<"  --metrics file.json   write render metrics\n"
+           <<"  --perf                add hardware counters to the metrics\n"
+           <<"  --trace file.json     write a chrome trace timeline\n";
+}
 
-void func_whole(size_t num_pixels, uint32_t** pixels, uint32_t* channels_max, uint32_t* result) {
-  for (size_t i = 0; i < num_pixels; ++i) {
-    uint8_t* c = (uint8_t*) (result + i);
-    c[0] = (uint8_t) (255.0 * pixels[0][i] / channels_max[0]);
-    c[1] = (uint8_t) (255.0 * pixels[0][i] / channels_max[0]);
-    c[2] = (uint8_t) (255.0 * pixels[0][i] / channels_max[0]);
-    c[3] = 0xff;
+template <typename T>
+bool parseValue(const char* str, T& value) {
+  std::istringstream is(str);
+  is>>value;
+  return !is.fail() && is.eof();
+}
+
+//false if the arguments are invalid or only help was requested, exit code in exit_code
+bool parseArguments(int argc, char** argv, int& exit_code) {
+  exit_code = 1;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    //number of values following the option
+    int needed = (arg == "--center" || arg == "--move-radius") ? 2 :
+                 (arg == "--perf" || arg == "--pin" || arg == "--adaptive" || arg == "--help" || arg == "-h") ? 0 : 1;
+    if (i + needed >= argc) {
+      std::cout<<"Missing value of "<<arg<<"\n";
+      return false;
+    }
+    bool ok = true;
+    if (arg == "--help" || arg == "-h") {
+      printUsage(argv[0]);
+      exit_code = 0;
+      return false;
+    } else if (arg == "--center") {
+      //all digits count in deep zooms
+      ok = parseDoubleDouble(argv[i + 1], xmid) && parseDoubleDouble(argv[i + 2], ymid);
+    } else if (arg == "--size") {
+      ok = parseValue(argv[i + 1], size) && size > 0;
+    } else if (arg == "--width") {
+      ok = parseValue(argv[i + 1], width) && width > 0;
+    } else if (arg == "--height") {
+      ok = parseValue(argv[i + 1], height) && height > 0;
+    } else if (arg == "--iterations") {
+      ok = parseValue(argv[i + 1], iterations);
+    } else if (arg == "--random-radius") {
+      ok = parseValue(argv[i + 1], random_radius) && random_radius > 0;
+    } else if (arg == "--norm-limit") {
+      ok = parseValue(argv[i + 1], norm_limit) && norm_limit > 0;
+    } else if (arg == "--threads") {
+      ok = parseValue(argv[i + 1], threads) && threads > 0;
+    } else if (arg == "--seed") {
+      ok = parseValue(argv[i + 1], seed);
+      deterministic = true;
+    } else if (arg == "--precision") {
+      std::string name = argv[i + 1];
+      ok = false;
+      for (RendererPrecision p : {PRECISION_AUTO, PRECISION_FLOAT, PRECISION_DOUBLE, PRECISION_DOUBLE_DOUBLE,
+                                PRECISION_PERTURBATION}) {
+        if (name == precisionName(p)) {
+          precision = p;
+          ok = true;
+        }
+      }
+    } else if (arg == "--estimator") {
+      std::string name = argv[i + 1];
+      ok = false;
+      for (SplatEstimator e : {SPLAT_ACCEPTED, SPLAT_EXPECTED}) {
+        if (name == estimatorName(e)) {
+          estimator = e;
+          ok = true;
+        }
+      }
+    } else if (arg == "--chains") {
+      ok = parseValue(argv[i + 1], mutation.chains) && mutation.chains > 0;
+    } else if (arg == "--random-fraction") {
+      ok = parseValue(argv[i + 1], mutation.random_fraction) &&
+           mutation.random_fraction >= 0 && mutation.random_fraction <= 1;
+    } else if (arg == "--move-radius") {
+      ok = parseValue(argv[i + 1], mutation.move_min) && parseValue(argv[i + 2], mutation.move_max) &&
+           mutation.move_min > 0 && mutation.move_max >= mutation.move_min;
+    } else if (arg == "--adaptive") {
+      mutation.adaptive = true;
+    } else if (arg == "--output") {
+      output_dir = argv[i + 1];
+    } else if (arg == "--load") {
+      load_file = argv[i + 1];
+    } else if (arg == "--save") {
+      save_file = argv[i + 1];
+    } else if (arg == "--metrics") {
+      metrics_file = argv[i + 1];
+    } else if (arg == "--perf") {
+      perf_counters = true;
+    } else if (arg == "--pin") {
+      pin_threads = true;
+    } else if (arg == "--trace") {
+      trace_file = argv[i + 1];
+    } else {
+      std::cout<<"Unknown option: "<<arg<<"\n";
+      printUsage(argv[0]);
+      return false;
+    }
+    if (!ok) {
+      std::cout<<"Invalid value of "<<arg<<"\n";
+      return false;
+    }
+    i += needed;
   }
+  return true;
 }
 
-int main() {
+int main(int argc, char** argv) {
+  int exit_code;
+  if (threads == 0) {
+    threads = 1;
+  }
+  if (!parseArguments(argc, argv, exit_code)) {
+    return exit_code;
+  }
   /*
   auto time0 = std::chrono::high_resolution_clock::now();
 
@@ -161,35 +307,59 @@ int main() {
   logMessage("Loaded function in " + std::to_string(time) + "seconds");
 */
 
-  size_t threads = std::thread::hardware_concurrency();
+  //one pool of threads serves rendering, images and file transfers, reused by every execute; pinned only with --pin
+  ThreadPool::setSharedSize(threads, pin_threads);
 
   NebulabrotRenderingManager manager(xmid, ymid, size, random_radius, norm_limit, width, height, threads);
-  manager.add("i1", NebulabrotIterationData(32, iterations, InnerFunctionData(func, 1)));
-  manager.add("i2", NebulabrotIterationData(45, iterations, InnerFunctionData(func, 1)));
-  manager.add("i3", NebulabrotIterationData(64, iterations, InnerFunctionData(func, 1)));
-  manager.add("i4", NebulabrotIterationData(91, iterations, InnerFunctionData(func, 1)));
-  manager.add("i5", NebulabrotIterationData(128, iterations, InnerFunctionData(func, 1)));
-  manager.add("i6", NebulabrotIterationData(181, iterations, InnerFunctionData(func, 1)));
-  manager.add("i7", NebulabrotIterationData(256, iterations, InnerFunctionData(func, 1)));
-  auto collection = manager.execute();
-
-  //NebulabrotChannelCollection collection_raw(width, height);
-  //collection_raw.loadFile("raw");
-  //collection.merge(collection_raw);
-  //collection.saveFile("raw");
+  InnerFunctionData inner_func(func<double>, func<float>, func<DoubleDouble>, funcPerturbation, 1);
+  auto channel = [&inner_func](size_t inner_iterations) {
+    NebulabrotIterationData data(inner_iterations, iterations, inner_func, precision, estimator);
+    data.mutation = mutation;
+    return data;
+  };
+  manager.add("i1", channel(32));
+  manager.add("i2", channel(45));
+  manager.add("i3", channel(64));
+  manager.add("i4", channel(91));
+  manager.add("i5", channel(128));
+  manager.add("i6", channel(181));
+  manager.add("i7", channel(256));
+  if (!metrics_file.empty()) {
+    manager.setMetricsFile(metrics_file);
+  }
+  manager.setPerfCounters(perf_counters);
+  manager.setDeterministic(deterministic, seed);
+  if (!trace_file.empty()) {
+    Trace::enable();
+  }
+  NebulabrotChannelCollection collection(width, height);
+  if (!load_file.empty() && !collection.loadFile(load_file)) {
+    return 1;
+  }
 
-  ImageRenderingManager img_manager(threads);
-  img_manager.add("iall", ImageOutputData(ImageFunctionData(img_func, {"i1", "i2", "i3", "i4", "i5", "i6", "i7"}, {}), &collection));
-  img_manager.add("i1", ImageOutputData(ImageFunctionData(img_monochrome, {"i1"}, {}), &collection));
-  img_manager.add("i2", ImageOutputData(ImageFunctionData(img_monochrome, {"i2"}, {}), &collection));
-  img_manager.add("i3", ImageOutputData(ImageFunctionData(img_monochrome, {"i3"}, {}), &collection));
-  img_manager.add("i4", ImageOutputData(ImageFunctionData(img_monochrome, {"i4"}, {}), &collection));
-  img_manager.add("i5", ImageOutputData(ImageFunctionData(img_monochrome, {"i5"}, {}), &collection));
-  img_manager.add("i6", ImageOutputData(ImageFunctionData(img_monochrome, {"i6"}, {}), &collection));
-  img_manager.add("i7", ImageOutputData(ImageFunctionData(img_monochrome, {"i7"}, {}), &collection));
+  ImageFunctionData all_func(img_func, {"i1", "i2", "i3", "i4", "i5", "i6", "i7", "i2", "i4", "i6"}, {});
+  all_func.transfers = std::vector<ChannelTransfer>(7, CURVE_SQRT);
+  all_func.transfers.resize(10, CURVE_LINEAR);
+  ImageFunctionData monochrome_func(spanMonochrome<transferLinear>, {"i1"}, {});
+  monochrome_func.transfers = {CURVE_SQRT};
 
+  ImageRenderingManager img_manager(threads);
+  img_manager.add(output_dir + "/iall", ImageOutputData(all_func, &collection));
+  for (const char* name : {"i1", "i2", "i3", "i4", "i5", "i6", "i7"}) {
+    monochrome_func.channel_names = {name};
+    img_manager.add(output_dir + "/" + name, ImageOutputData(monochrome_func, &collection));
+  }
 
-  img_manager.execute();
+  //images are saved while the remaining channels are still rendering
+  if (!manager.execute(collection, &img_manager)) {
+    return 1;
+  }
+  if (!save_file.empty() && !collection.saveFile(save_file)) {
+    return 1;
+  }
+  if (!trace_file.empty() && !Trace::save(trace_file)) {
+    return 1;
+  }
 
   return 0;
 }
@@ -0,0 +1,146 @@
+#include "numa.h"
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace {
+
+std::unique_ptr<NumaTopology> topology;
+std::mutex topology_mutex;
+
+std::vector<int> allowedCpus() {
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+      if (CPU_ISSET(i, &set)) {
+        cpus.push_back(i);
+      }
+    }
+  }
+#endif
+  if (cpus.empty()) {
+    cpus.push_back(0);
+  }
+  return cpus;
+}
+
+//parses lists like "0-3,8,10-11"
+std::vector<int> parseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    size_t dash = range.find('-');
+    try {
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    } catch (const std::exception&) {
+      continue;
+    }
+  }
+  return cpus;
+}
+
+}
+
+NumaTopology::NumaTopology() {
+  node_cpus.push_back(allowedCpus());
+}
+
+NumaTopology NumaTopology::detect(const std::string& sysfs_path) {
+  NumaTopology result;
+  std::vector<int> allowed = result.node_cpus[0];
+  std::vector<std::vector<int>> nodes;
+  //node numbers can have gaps, empty nodes (memory only) are skipped
+  for (size_t node = 0, missing = 0; missing < 64; ++node) {
+    std::ifstream fs(sysfs_path + "/node" + std::to_string(node) + "/cpulist");
+    if (!fs.is_open()) {
+      missing++;
+      continue;
+    }
+    missing = 0;
+    std::string list;
+    std::getline(fs, list);
+    std::vector<int> cpus;
+    for (int cpu : parseCpuList(list)) {
+      if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+        cpus.push_back(cpu);
+      }
+    }
+    if (!cpus.empty()) {
+      nodes.push_back(cpus);
+    }
+  }
+  if (nodes.empty()) {
+    return result;
+  }
+  result.node_cpus = nodes;
+  for (size_t node = 0; node < nodes.size(); ++node) {
+    for (int cpu : nodes[node]) {
+      if ((size_t) cpu >= result.cpu_nodes.size()) {
+        result.cpu_nodes.resize(cpu + 1, 0);
+      }
+      result.cpu_nodes[cpu] = node;
+    }
+  }
+  return result;
+}
+
+const NumaTopology& NumaTopology::get() {
+  std::lock_guard<std::mutex> lock(topology_mutex);
+  if (!topology) {
+    topology.reset(new NumaTopology(detect()));
+  }
+  return *topology;
+}
+
+void NumaTopology::set(const NumaTopology& new_topology) {
+  std::lock_guard<std::mutex> lock(topology_mutex);
+  topology.reset(new NumaTopology(new_topology));
+}
+
+size_t NumaTopology::getNumNodes() const {
+  return node_cpus.size();
+}
+
+const std::vector<int>& NumaTopology::getNodeCpus(size_t node) const {
+  return node_cpus[node];
+}
+
+std::vector<int> NumaTopology::getCpusByNode() const {
+  std::vector<int> cpus;
+  for (auto& node : node_cpus) {
+    cpus.insert(cpus.end(), node.begin(), node.end());
+  }
+  return cpus;
+}
+
+size_t NumaTopology::getNodeOfCpu(int cpu) const {
+  if (cpu < 0 || (size_t) cpu >= cpu_nodes.size()) {
+    return 0;
+  }
+  return cpu_nodes[cpu];
+}
+
+size_t NumaTopology::getCurrentNode() const {
+  if (node_cpus.size() == 1) {
+    return 0;
+  }
+#ifdef __linux__
+  return getNodeOfCpu(sched_getcpu());
+#else
+  return 0;
+#endif
+}
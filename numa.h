@@ -0,0 +1,32 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+//numa nodes and their cpus as seen in sysfs, restricted to cpus the process may run on
+class NumaTopology {
+public:
+  //single node with all allowed cpus
+  NumaTopology();
+  //reads node*/cpulist from the given sysfs directory, falls back to a single node if there is none
+  static NumaTopology detect(const std::string& sysfs_path = "/sys/devices/system/node");
+  //topology detected on first use, can be replaced before any rendering starts
+  static const NumaTopology& get();
+  static void set(const NumaTopology& topology);
+
+  size_t getNumNodes() const;
+  const std::vector<int>& getNodeCpus(size_t node) const;
+  //all cpus ordered node by node, so consecutive threads share a node
+  std::vector<int> getCpusByNode() const;
+  size_t getNodeOfCpu(int cpu) const;
+  //node of the cpu the calling thread is running on, 0 if unknown
+  size_t getCurrentNode() const;
+
+private:
+  std::vector<std::vector<int>> node_cpus;
+  std::vector<size_t> cpu_nodes;
+};
+
+#endif
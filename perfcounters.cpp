@@ -0,0 +1,123 @@
+#include "perfcounters.h"
+
+#include <sstream>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+namespace {
+
+const char* const EVENT_NAMES[PERF_NUM_EVENTS] = {"cycles", "instructions", "llc_misses", "dtlb_misses"};
+
+#ifdef __linux__
+int openEvent(uint32_t type, uint64_t config) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+}
+
+void PerfValues::add(const PerfValues& begin, const PerfValues& end) {
+  for (size_t i = 0; i < PERF_NUM_EVENTS; ++i) {
+    if (begin.valid[i] && end.valid[i]) {
+      //scaled estimates of multiplexed counters may go slightly backwards
+      counts[i] += end.counts[i] > begin.counts[i] ? end.counts[i] - begin.counts[i] : 0;
+      valid[i] = true;
+    }
+  }
+  sections++;
+}
+
+std::string PerfValues::toJson() const {
+  bool any = false;
+  for (size_t i = 0; i < PERF_NUM_EVENTS; ++i) {
+    any = any || valid[i];
+  }
+  if (!any) {
+    return "null";
+  }
+  std::ostringstream os;
+  os<<"{\"sections\": "<<sections;
+  for (size_t i = 0; i < PERF_NUM_EVENTS; ++i) {
+    os<<", \""<<EVENT_NAMES[i]<<"\": ";
+    if (valid[i]) {
+      os<<counts[i];
+    } else {
+      os<<"null";
+    }
+  }
+  if (valid[PERF_CYCLES] && valid[PERF_INSTRUCTIONS] && counts[PERF_CYCLES] > 0) {
+    os<<", \"ipc\": "<<(double) counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES];
+  }
+  if (valid[PERF_INSTRUCTIONS] && valid[PERF_LLC_MISSES] && counts[PERF_INSTRUCTIONS] > 0) {
+    os<<", \"llc_misses_per_kilo_instruction\": "<<1000.0 * counts[PERF_LLC_MISSES] / counts[PERF_INSTRUCTIONS];
+  }
+  os<<"}";
+  return os.str();
+}
+
+PerfCounters::PerfCounters() {
+  for (size_t i = 0; i < PERF_NUM_EVENTS; ++i) {
+    fds[i] = -1;
+  }
+#ifdef __linux__
+  fds[PERF_CYCLES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  fds[PERF_INSTRUCTIONS] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  fds[PERF_LLC_MISSES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  fds[PERF_DTLB_MISSES] = openEvent(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+  for (size_t i = 0; i < PERF_NUM_EVENTS; ++i) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+#endif
+}
+
+bool PerfCounters::isAvailable() const {
+  for (size_t i = 0; i < PERF_NUM_EVENTS; ++i) {
+    if (fds[i] >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+PerfValues PerfCounters::read() const {
+  PerfValues result;
+#ifdef __linux__
+  for (size_t i = 0; i < PERF_NUM_EVENTS; ++i) {
+    //value, time enabled, time running
+    uint64_t data[3];
+    if (fds[i] < 0 || ::read(fds[i], data, sizeof(data)) != sizeof(data)) {
+      continue;
+    }
+    if (data[2] == 0) {
+      result.counts[i] = 0;
+    } else if (data[2] < data[1]) {
+      result.counts[i] = (uint64_t) ((double) data[0] * data[1] / data[2]);
+    } else {
+      result.counts[i] = data[0];
+    }
+    result.valid[i] = true;
+  }
+#endif
+  return result;
+}
@@ -0,0 +1,40 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+enum PerfEvent {
+  PERF_CYCLES = 0, PERF_INSTRUCTIONS = 1, PERF_LLC_MISSES = 2, PERF_DTLB_MISSES = 3, PERF_NUM_EVENTS = 4
+};
+
+//counts summed over measured sections, events that couldn't be opened stay invalid
+struct PerfValues {
+  uint64_t counts[PERF_NUM_EVENTS] = {};
+  bool valid[PERF_NUM_EVENTS] = {};
+  size_t sections = 0;
+
+  void add(const PerfValues& begin, const PerfValues& end);
+  //json object with counts and derived ratios, null if nothing was measured
+  std::string toJson() const;
+};
+
+//hardware counters of the calling thread (user space only) via perf_event_open, linux only
+//when perf events aren't permitted or supported, isAvailable() is false and all reads give invalid values
+class PerfCounters {
+public:
+  PerfCounters();
+  PerfCounters(const PerfCounters& other) = delete;
+  PerfCounters& operator=(const PerfCounters& other) = delete;
+  ~PerfCounters();
+
+  bool isAvailable() const;
+  //current counts, scaled if the kernel multiplexed the counters
+  PerfValues read() const;
+
+private:
+  int fds[PERF_NUM_EVENTS];
+};
+
+#endif
@@ -0,0 +1,428 @@
+#ifndef NEBULABROTGEN_PERTURBATIONRENDERER_HPP
+#define NEBULABROTGEN_PERTURBATIONRENDERER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#include "kernels.h"
+#include "rng.hpp"
+
+//kernels.cpp compiles the renderer once per instruction set, each copy in its own namespace
+#ifdef NEBULABROTGEN_KERNELS
+namespace NEBULABROTGEN_KERNELS {
+#endif
+
+//squared ratio of |z| to |reference| below which the offset lost the bits z is made of (pauldelbrot's criterion)
+const double PERTURBATION_GLITCH_TOLERANCE = 1e-6;
+//rounding of on-screen points has to stay below this fraction of a pixel
+const double PERTURBATION_PIXEL_FRACTION = 16;
+//seeds pass the view after at most this many steps, solved with at most PERTURBATION_NEWTON_STEPS newton steps
+const size_t PERTURBATION_SEED_STEPS = 32;
+const int PERTURBATION_NEWTON_STEPS = 64;
+
+//renderer for views too small for double: every chain computes the orbit of its current point in double-double
+//once and keeps it as the reference, proposals near it are iterated as double offsets from it with the
+//perturbation form of the inner function, only the ones the offsets can't represent (glitches) are computed in
+//double-double again and become the reference when accepted
+//proposals are moves only, random points of the plane practically never reach such a view
+template<typename generator_t = XoshiroGenerator>
+class PerturbationRenderer {
+public:
+  typedef DoubleDouble real_type;
+
+  PerturbationRenderer(size_t width, size_t height, size_t max_iter, size_t init_points, InnerFuncDoubleDouble func,
+                       InnerFuncPerturbation perturbation, double norm_limit)
+      : width(width), height(height), max_iter(max_iter), init_points(init_points), norm_limit(norm_limit),
+        estimator(SPLAT_ACCEPTED), orbit_x(max_iter), orbit_y(max_iter), state_x(max_iter), state_y(max_iter),
+        initial(init_points), func(func), perturbation(perturbation) {
+    random.seed(nextRendererSeed());
+    setMutation(MutationParameters());
+    reference.reserve(max_iter + 1);
+    candidate.reserve(max_iter + 1);
+  }
+
+  void setArea(const DoubleDouble& xmid, const DoubleDouble& ymid, const DoubleDouble& factor) {
+    this->mid = {xmid, ymid};
+    this->factor = (double) factor;
+    double diff_x = width * 2.0 * this->factor / (width + height);
+    double diff_y = height * 2.0 * this->factor / (width + height);
+    this->half = {diff_x * 0.5, diff_y * 0.5};
+    this->scale = {width / diff_x, height / diff_y};
+    this->max_error = this->factor * 2.0 / (width + height) / PERTURBATION_PIXEL_FRACTION;
+  }
+
+  void setSplatEstimator(SplatEstimator estimator) {
+    this->estimator = estimator;
+  }
+
+  //proposals are moves only, see the class
+  void setMutation(const MutationParameters& mutation) {
+    this->mutation = mutation;
+    this->mutation.random_fraction = 0;
+    configured_mutation = this->mutation;
+    move_log_ratio = std::log(mutation.move_max / mutation.move_min);
+  }
+
+  const MutationParameters& getMutation() const {
+    return mutation;
+  }
+
+  void prepareInitialPoints() {
+    for (size_t i = 0; i < init_points; ++i) {
+      do {
+      } while (!findInitialPointAttempt(initial[i]));
+    }
+  }
+
+  void tuneMutation() {
+    tuneChains(0, init_points);
+  }
+
+  //computes a single orbit of c, returns the number of iterations done
+  size_t orbitIterations(std::complex<DoubleDouble> c) {
+    computeReference(c, reference);
+    return curr_iter;
+  }
+
+  const RendererStats& getStats() const {
+    return stats;
+  }
+
+  void resetStats() {
+    stats = RendererStats();
+  }
+
+  void outputPointValues(uint32_t* out, size_t iterations) {
+    for (size_t i = 0; i < init_points; ++i) {
+      runChain(out, i, iterations);
+    }
+  }
+
+  //same as BuddhabrotRenderer::outputSeededPointValues
+  void outputSeededPointValues(uint32_t* out, size_t iterations, uint64_t key) {
+    for (size_t i = 0; i < init_points; ++i) {
+      uint64_t chain_key = key ^ (i * 0x9e3779b97f4a7c15ull);
+      random.seed(splitMix64(chain_key));
+      do {
+      } while (!findInitialPointAttempt(initial[i]));
+      mutation = configured_mutation;
+      tuneChains(i, i + 1);
+      runChain(out, i, iterations);
+    }
+  }
+
+private:
+  struct ReferencePoint {
+    //point of the orbit and its offset from the centre of the view, both rounded from double-double
+    std::complex<double> z, offset;
+  };
+
+  void runChain(uint32_t* out, size_t i, size_t iterations) {
+    startChain(i);
+    if (mutation.adaptive) {
+      runStateChain(out, i, iterations);
+      return;
+    }
+    outputOrbit(out, estimator == SPLAT_EXPECTED ? SPLAT_WEIGHT_SCALE : 1);
+    for (size_t j = 0; j < iterations; ++j) {
+
+      bool accepted;
+      double alpha = step(i, accepted);
+      if (estimator == SPLAT_EXPECTED && alpha > 0) {
+        outputOrbit(out, static_cast<uint32_t>(alpha * SPLAT_WEIGHT_SCALE + uniform()));
+      }
+      if (accepted && estimator == SPLAT_ACCEPTED) {
+        outputOrbit(out, 1);
+      }
+    }
+  }
+
+  //see BuddhabrotRenderer::runStateChain, the state's pixels are kept instead of iterating it again
+  void runStateChain(uint32_t* out, size_t i, size_t iterations) {
+    double holding = 0;
+    keepState();
+    for (size_t j = 0; j < iterations; ++j) {
+
+      bool accepted;
+      double alpha = step(i, accepted);
+      if (estimator == SPLAT_EXPECTED) {
+        if (alpha > 0) {
+          outputOrbit(out, static_cast<uint32_t>(alpha * SPLAT_WEIGHT_SCALE + uniform()));
+        }
+        holding += 1.0 - alpha;
+      }
+      if (accepted) {
+        outputState(out, holding);
+        holding = 0;
+        keepState();
+      }
+      if (estimator == SPLAT_ACCEPTED) {
+        holding += 1.0;
+      }
+    }
+    outputState(out, holding);
+  }
+
+  //pixels of the orbit computed last become the chain's state
+  void keepState() {
+    std::copy(orbit_x.begin(), orbit_x.begin() + curr_on_screen, state_x.begin());
+    std::copy(orbit_y.begin(), orbit_y.begin() + curr_on_screen, state_y.begin());
+    state_on_screen = curr_on_screen;
+  }
+
+  void outputState(uint32_t* out, double holding) {
+    uint32_t weight = estimator == SPLAT_EXPECTED ? static_cast<uint32_t>(holding * SPLAT_WEIGHT_SCALE + uniform())
+                                                  : static_cast<uint32_t>(holding);
+    for (size_t k = 0; k < state_on_screen; ++k) {
+      out[state_y[k] * width + state_x[k]] += weight;
+    }
+  }
+
+  void startChain(size_t i) {
+    reference_c = initial[i];
+    computeReference(reference_c, reference);
+    prev_contrib = curr_contrib;
+    prev_on_screen = curr_on_screen;
+    dc = std::complex<double>();
+  }
+
+  //see BuddhabrotRenderer::step, the proposal's orbit is the one computed last
+  double step(size_t i, bool& accepted) {
+    std::complex<double> x = dc + moveOffset();
+    ++stats.proposals;
+    accepted = false;
+    bool perturbed = computePerturbed(x);
+    if (!perturbed) {
+      ++stats.glitches;
+      computeReference(reference_c + toDoubleDouble(x), candidate);
+    }
+    if (curr_iter == max_iter) {
+      ++stats.rejected_non_escaping;
+      return 0;
+    }
+    if (curr_on_screen == 0) {
+      ++stats.rejected_off_screen;
+      return 0;
+    }
+    double alpha = acceptanceProbability(curr_contrib, curr_on_screen, prev_contrib, prev_on_screen, max_iter);
+
+    accepted = alpha > uniform();
+    if (accepted) {
+      prev_contrib = curr_contrib;
+      prev_on_screen = curr_on_screen;
+      if (perturbed) {
+        dc = x;
+      } else {
+        reference.swap(candidate);
+        reference_c += toDoubleDouble(x);
+        dc = std::complex<double>();
+      }
+      initial[i] = reference_c + toDoubleDouble(dc);
+      ++stats.accepted;
+    }
+    return alpha;
+  }
+
+  //see BuddhabrotRenderer::tuneChains, only the move radii
+  void tuneChains(size_t first, size_t last) {
+    if (!mutation.adaptive) {
+      return;
+    }
+    RendererStats saved = stats;
+    size_t moves = 0;
+    for (size_t i = first; i < last; ++i) {
+      startChain(i);
+      for (size_t j = 0; j < mutation.burn_in; ++j) {
+
+        bool accepted;
+        step(i, accepted);
+        adaptMoveRadius(mutation, accepted, moves++);
+      }
+    }
+    stats = saved;
+  }
+
+  //see BuddhabrotRenderer::outputOrbit
+  void outputOrbit(uint32_t* out, uint32_t weight) {
+    for (size_t k = 0; k < curr_on_screen; ++k) {
+      out[orbit_y[k] * width + orbit_x[k]] += weight;
+    }
+  }
+
+  static std::complex<double> toDouble(const std::complex<DoubleDouble>& value) {
+    return std::complex<double>((double) value.real(), (double) value.imag());
+  }
+
+  static std::complex<DoubleDouble> toDoubleDouble(const std::complex<double>& value) {
+    return std::complex<DoubleDouble>(value.real(), value.imag());
+  }
+
+  double uniform() {
+    return random();
+  }
+
+  //radius between factor * move_min and factor * move_max, log-uniformly
+  std::complex<double> moveOffset() {
+    double phi = uniform() * (M_PI * 2.0);
+    double r = factor * mutation.move_max * std::exp(-move_log_ratio * uniform());
+    return std::complex<double>(r * std::cos(phi), r * std::sin(phi));
+  }
+
+  //adds offset (from the centre) to the orbit if it's on screen
+  void addPoint(std::complex<double> offset) {
+    if (std::abs(offset.real()) < half.real() && std::abs(offset.imag()) < half.imag()) {
+      //points just inside the view can round to its far edge
+      orbit_x[curr_on_screen] = static_cast<uint16_t>(std::min((double) (width - 1),
+                                                               (offset.real() + half.real()) * scale.real()));
+      orbit_y[curr_on_screen] = static_cast<uint16_t>(std::min((double) (height - 1),
+                                                               (offset.imag() + half.imag()) * scale.imag()));
+      ++curr_on_screen;
+    }
+  }
+
+  //orbit of c in double-double, stored in ref from z0 to the escaping point
+  void computeReference(const std::complex<DoubleDouble>& c, std::vector<ReferencePoint>& ref) {
+    using std::isfinite;
+    std::complex<DoubleDouble> a;
+    ref.clear();
+    ref.push_back({std::complex<double>(), toDouble(a - mid)});
+    curr_on_screen = 0;
+    curr_iter = 0;
+    for (size_t j = 0; j < max_iter; ++j) {
+
+      func(a, c);
+      if (!isfinite(a.real())) {
+        throw std::runtime_error("nan detected");
+      }
+      ReferencePoint point = {toDouble(a), toDouble(a - mid)};
+      ref.push_back(point);
+      addPoint(point.offset);
+
+      if (std::norm(point.z) > norm_limit) {
+        if (curr_iter == 0) {
+          ++curr_iter;
+        }
+        break;
+      }
+      ++curr_iter;
+    }
+    curr_contrib = ((double) curr_on_screen) / curr_iter;
+  }
+
+  //orbit of the reference's c + dc from the offsets to the reference, false if they can't represent it
+  bool computePerturbed(std::complex<double> dc) {
+    const double epsilon = std::numeric_limits<double>::epsilon();
+    std::complex<double> dz;
+    curr_on_screen = 0;
+    curr_iter = 0;
+    for (size_t j = 0; j < max_iter; ++j) {
+
+      //the reference escaped before
+      if (j + 1 >= reference.size()) {
+        return false;
+      }
+      perturbation(dz, reference[j].z, dc);
+      const ReferencePoint& point = reference[j + 1];
+      std::complex<double> z = point.z + dz;
+      if (!std::isfinite(dz.real()) || std::norm(z) < PERTURBATION_GLITCH_TOLERANCE * std::norm(point.z)) {
+        return false;
+      }
+      std::complex<double> offset = point.offset + dz;
+      size_t on_screen = curr_on_screen;
+      addPoint(offset);
+      if (curr_on_screen != on_screen &&
+          (std::abs(point.offset.real()) + std::abs(point.offset.imag()) + std::abs(dz.real()) + std::abs(dz.imag()))
+          * epsilon > max_error) {
+        return false;
+      }
+
+      if (std::norm(z) > norm_limit) {
+        if (curr_iter == 0) {
+          ++curr_iter;
+        }
+        break;
+      }
+      ++curr_iter;
+    }
+    curr_contrib = ((double) curr_on_screen) / curr_iter;
+    return true;
+  }
+
+  //newton's method for a c whose orbit passes a random point of the view after a random number of steps, the
+  //derivative comes from the perturbation form with a tiny dc; the orbit then has to escape
+  bool findInitialPointAttempt(std::complex<DoubleDouble>& num) {
+    size_t max_steps = std::min(max_iter - 1, PERTURBATION_SEED_STEPS);
+    size_t steps = 1 + std::min((size_t) (uniform() * max_steps), max_steps - 1);
+    std::complex<double> target(half.real() * (uniform() * 2.0 - 1.0), half.imag() * (uniform() * 2.0 - 1.0));
+    double phi = uniform() * (M_PI * 2.0);
+    double r = uniform() * 2.0;
+    std::complex<DoubleDouble> c(r * std::cos(phi), r * std::sin(phi));
+    const std::complex<double> h(std::ldexp(1.0, -500), 0);
+    for (int i = 0; i < PERTURBATION_NEWTON_STEPS; ++i) {
+
+      std::complex<DoubleDouble> z;
+      std::complex<double> dz;
+      for (size_t k = 0; k < steps; ++k) {
+        perturbation(dz, toDouble(z), h);
+        func(z, c);
+      }
+      std::complex<double> error = toDouble(z - mid) - target;
+      if (std::norm(error) < max_error * max_error) {
+        computeReference(c, reference);
+        if (curr_iter == max_iter || curr_on_screen == 0) {
+          return false;
+        }
+        num = c;
+        return true;
+      }
+      std::complex<double> step = error / (dz / h);
+      //diverging or not a number
+      if (!(std::norm(step) < 16.0)) {
+        return false;
+      }
+      c -= toDoubleDouble(step);
+    }
+    return false;
+  }
+
+  size_t width, height, max_iter, init_points;
+  std::complex<DoubleDouble> mid;
+  //half of the view's size, pixels per unit
+  std::complex<double> half, scale;
+  double factor;
+  //largest rounding error of an on-screen point
+  double max_error;
+  double norm_limit;
+  size_t curr_iter, curr_on_screen, prev_on_screen;
+  double curr_contrib, prev_contrib;
+  SplatEstimator estimator;
+  std::vector<uint16_t> orbit_x;
+  std::vector<uint16_t> orbit_y;
+  //pixels of the current state of an adaptive chain
+  std::vector<uint16_t> state_x;
+  std::vector<uint16_t> state_y;
+  size_t state_on_screen;
+  std::vector<std::complex<DoubleDouble>> initial;
+  //orbit of the current chain's reference and of a glitched proposal
+  std::vector<ReferencePoint> reference, candidate;
+  //the current chain's reference point and offset of its point from it
+  std::complex<DoubleDouble> reference_c;
+  std::complex<double> dc;
+  //see BuddhabrotRenderer
+  MutationParameters mutation, configured_mutation;
+  double move_log_ratio;
+  UniformSource<generator_t> random;
+  RendererStats stats;
+
+  InnerFuncDoubleDouble func;
+  InnerFuncPerturbation perturbation;
+};
+
+#ifdef NEBULABROTGEN_KERNELS
+}
+#endif
+
+#endif
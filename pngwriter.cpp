@@ -0,0 +1,657 @@
+#include "pngwriter.h"
+#include "threadpool.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <thread>
+
+namespace {
+
+const size_t WINDOW_SIZE = 32768;
+const size_t MIN_MATCH = 3;
+const size_t MAX_MATCH = 258;
+const size_t HASH_BITS = 15;
+const size_t BLOCK_SYMBOLS = 1 << 16;
+const size_t MAX_STORED_BLOCK = 65535;
+const size_t BAND_BYTES = 1 << 20;
+const int32_t NO_POSITION = -1;
+
+struct CompressionLevel {
+  size_t max_chain;
+  size_t nice_length;
+  bool lazy;
+};
+
+const CompressionLevel LEVELS[] = {{0, 0, false}, {4, 16, false}, {32, 128, true}, {1024, MAX_MATCH, true}};
+const uint8_t ZLIB_LEVEL_FLAGS[] = {0x01, 0x01, 0x9c, 0xda};
+
+const uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DIST_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+                                8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+const uint8_t CODE_LENGTH_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+const uint32_t* crcTable() {
+  static struct Table {
+    Table() {
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+          c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        values[i] = c;
+      }
+    }
+    uint32_t values[256];
+  } table;
+  return table.values;
+}
+
+uint32_t crc32(uint32_t crc, const uint8_t* data, size_t len) {
+  const uint32_t* table = crcTable();
+  crc = ~crc;
+  for (size_t i = 0; i < len; ++i) {
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+const uint32_t ADLER_BASE = 65521;
+
+uint32_t adler32(uint32_t adler, const uint8_t* data, size_t len) {
+  uint32_t a = adler & 0xffff;
+  uint32_t b = adler >> 16;
+  while (len > 0) {
+    //5552 bytes is the most that can be summed before b can overflow
+    size_t n = std::min(len, (size_t) 5552);
+    len -= n;
+    for (size_t i = 0; i < n; ++i) {
+      a += data[i];
+      b += a;
+    }
+    data += n;
+    a %= ADLER_BASE;
+    b %= ADLER_BASE;
+  }
+  return a | (b << 16);
+}
+
+//checksum of concatenated data given checksums of both parts and length of the second one
+uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+  uint32_t rem = len2 % ADLER_BASE;
+  uint32_t sum1 = adler1 & 0xffff;
+  uint32_t sum2 = (uint32_t) (((uint64_t) rem * sum1) % ADLER_BASE);
+  sum1 += (adler2 & 0xffff) + ADLER_BASE - 1;
+  sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+  if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+  if (sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+  if (sum2 >= (ADLER_BASE << 1)) sum2 -= (ADLER_BASE << 1);
+  if (sum2 >= ADLER_BASE) sum2 -= ADLER_BASE;
+  return sum1 | (sum2 << 16);
+}
+
+void parallelFor(size_t count, size_t num_threads, const std::function<void(size_t)>& func) {
+  num_threads = std::max((size_t) 1, std::min(num_threads, count));
+  std::atomic<size_t> next(0);
+  auto thread_function = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      func(i);
+    }
+  };
+  ThreadPool::shared().run(num_threads, [&](size_t) { thread_function(); });
+}
+
+class BitWriter {
+public:
+  explicit BitWriter(std::vector<uint8_t>& out) : out(out), bits(0), count(0) {}
+
+  void write(uint32_t value, size_t n) {
+    bits |= (uint64_t) value << count;
+    count += n;
+    while (count >= 8) {
+      out.push_back((uint8_t) bits);
+      bits >>= 8;
+      count -= 8;
+    }
+  }
+
+  void align() {
+    if (count > 0) {
+      out.push_back((uint8_t) bits);
+      bits = 0;
+      count = 0;
+    }
+  }
+
+  std::vector<uint8_t>& out;
+
+private:
+  uint64_t bits;
+  size_t count;
+};
+
+//length or distance code for a value, given table of base values
+inline size_t findCode(const uint16_t* base, size_t size, size_t value) {
+  return std::upper_bound(base, base + size, value) - base - 1;
+}
+
+void buildLengths(const std::vector<uint32_t>& freqs, size_t limit, std::vector<uint8_t>& lengths) {
+  lengths.assign(freqs.size(), 0);
+  std::vector<uint32_t> f(freqs);
+  std::vector<size_t> used;
+  for (size_t i = 0; i < f.size(); ++i) {
+    if (f[i] > 0) {
+      used.push_back(i);
+    }
+  }
+  if (used.empty()) {
+    return;
+  }
+  if (used.size() == 1) {
+    lengths[used[0]] = 1;
+    return;
+  }
+  typedef std::pair<uint64_t, size_t> Node;
+  while (true) {
+    std::priority_queue<Node, std::vector<Node>, std::greater<Node>> queue;
+    std::vector<size_t> parent(used.size() * 2 - 1);
+    for (size_t k = 0; k < used.size(); ++k) {
+      queue.push(Node(f[used[k]], k));
+    }
+    size_t next = used.size();
+    while (queue.size() > 1) {
+      Node a = queue.top();
+      queue.pop();
+      Node b = queue.top();
+      queue.pop();
+      parent[a.second] = next;
+      parent[b.second] = next;
+      queue.push(Node(a.first + b.first, next));
+      next++;
+    }
+    //parents are always created after their children
+    std::vector<uint8_t> depth(next, 0);
+    size_t max_depth = 0;
+    for (size_t i = next - 1; i-- > 0;) {
+      depth[i] = depth[parent[i]] + 1;
+      max_depth = std::max(max_depth, (size_t) depth[i]);
+    }
+    if (max_depth <= limit) {
+      for (size_t k = 0; k < used.size(); ++k) {
+        lengths[used[k]] = depth[k];
+      }
+      return;
+    }
+    //flatten the distribution until the tree fits in the limit
+    for (size_t i : used) {
+      f[i] = (f[i] + 1) / 2;
+    }
+  }
+}
+
+//canonical codes, bit reversed since deflate stores huffman codes starting from the most significant bit
+void buildCodes(const std::vector<uint8_t>& lengths, std::vector<uint16_t>& codes) {
+  uint16_t bl_count[16] = {0};
+  uint16_t next_code[16] = {0};
+  for (uint8_t len : lengths) {
+    bl_count[len]++;
+  }
+  bl_count[0] = 0;
+  uint16_t code = 0;
+  for (size_t bits = 1; bits < 16; ++bits) {
+    code = (code + bl_count[bits - 1]) << 1;
+    next_code[bits] = code;
+  }
+  codes.assign(lengths.size(), 0);
+  for (size_t i = 0; i < lengths.size(); ++i) {
+    size_t len = lengths[i];
+    if (len == 0) {
+      continue;
+    }
+    uint16_t c = next_code[len]++;
+    uint16_t reversed = 0;
+    for (size_t k = 0; k < len; ++k) {
+      reversed = (reversed << 1) | ((c >> k) & 1);
+    }
+    codes[i] = reversed;
+  }
+}
+
+struct LzSymbol {
+  LzSymbol(uint16_t length, uint16_t value) : length(length), value(value) {}
+  //0 for literals
+  uint16_t length;
+  //literal byte or match distance
+  uint16_t value;
+};
+
+class BandDeflater {
+public:
+  BandDeflater(const uint8_t* data, size_t dict_start, size_t start, size_t end,
+               const CompressionLevel& level, bool last, BitWriter& writer)
+      : data(data), dict_start(dict_start), start(start), end(end), level(level), last(last), writer(writer) {}
+
+  void run() {
+    if (level.max_chain == 0) {
+      writeStored(start, end, last);
+    } else {
+      compress();
+    }
+    if (!last) {
+      //empty stored block aligns the band to a byte boundary, so next band can be appended
+      writeStored(end, end, false);
+    }
+  }
+
+private:
+  struct Match {
+    size_t length;
+    size_t distance;
+  };
+
+  void writeStored(size_t begin, size_t finish, bool final) {
+    do {
+      size_t len = std::min(MAX_STORED_BLOCK, finish - begin);
+      bool final_block = final && begin + len == finish;
+      writer.write(final_block ? 1 : 0, 1);
+      writer.write(0, 2);
+      writer.align();
+      writer.write(len, 16);
+      writer.write(~len & 0xffff, 16);
+      writer.out.insert(writer.out.end(), data + begin, data + begin + len);
+      begin += len;
+    } while (begin < finish);
+  }
+
+  inline size_t hash(size_t pos) const {
+    return ((data[pos] << 10) ^ (data[pos + 1] << 5) ^ data[pos + 2]) & ((1 << HASH_BITS) - 1);
+  }
+
+  void insertUpTo(size_t target) {
+    for (; next_insert < target; ++next_insert) {
+      if (next_insert + MIN_MATCH <= end) {
+        size_t h = hash(next_insert);
+        prev[next_insert - dict_start] = head[h];
+        head[h] = (int32_t) (next_insert - dict_start);
+      }
+    }
+  }
+
+  Match findMatch(size_t pos) {
+    Match result = {0, 0};
+    if (pos + MIN_MATCH > end) {
+      return result;
+    }
+    size_t max_length = std::min(MAX_MATCH, end - pos);
+    size_t best_length = MIN_MATCH - 1;
+    size_t chain = level.max_chain;
+    int32_t candidate = head[hash(pos)];
+    while (candidate != NO_POSITION && chain-- > 0) {
+      size_t cand = dict_start + candidate;
+      if (pos - cand > WINDOW_SIZE) {
+        break;
+      }
+      if (data[cand + best_length] == data[pos + best_length] && data[cand] == data[pos]) {
+        size_t len = 0;
+        while (len < max_length && data[cand + len] == data[pos + len]) {
+          len++;
+        }
+        if (len > best_length) {
+          best_length = len;
+          result.length = len;
+          result.distance = pos - cand;
+          if (len >= level.nice_length || len == max_length) {
+            break;
+          }
+        }
+      }
+      candidate = prev[cand - dict_start];
+    }
+    return result;
+  }
+
+  void compress() {
+    head.assign(1 << HASH_BITS, NO_POSITION);
+    prev.assign(end - dict_start, NO_POSITION);
+    next_insert = dict_start;
+    block_start = start;
+    size_t pos = start;
+    Match cached = {0, 0};
+    size_t cached_pos = (size_t) -1;
+    while (pos < end) {
+      insertUpTo(pos);
+      Match match = cached_pos == pos ? cached : findMatch(pos);
+      if (match.length >= MIN_MATCH && level.lazy && match.length < level.nice_length && pos + 1 < end) {
+        insertUpTo(pos + 1);
+        cached = findMatch(pos + 1);
+        cached_pos = pos + 1;
+        if (cached.length > match.length) {
+          match.length = 0;
+        }
+      }
+      if (match.length >= MIN_MATCH) {
+        symbols.emplace_back(match.length, match.distance);
+        pos += match.length;
+      } else {
+        symbols.emplace_back(0, data[pos]);
+        pos++;
+      }
+      if (symbols.size() >= BLOCK_SYMBOLS) {
+        writeBlock(pos, false);
+      }
+    }
+    writeBlock(pos, last);
+  }
+
+  void writeBlock(size_t block_end, bool final) {
+    std::vector<uint32_t> lit_freqs(286, 0);
+    std::vector<uint32_t> dist_freqs(30, 0);
+    size_t extra_bits = 0;
+    for (const LzSymbol& s : symbols) {
+      if (s.length == 0) {
+        lit_freqs[s.value]++;
+      } else {
+        size_t lcode = findCode(LENGTH_BASE, 29, s.length);
+        size_t dcode = findCode(DIST_BASE, 30, s.value);
+        lit_freqs[257 + lcode]++;
+        dist_freqs[dcode]++;
+        extra_bits += LENGTH_EXTRA[lcode] + DIST_EXTRA[dcode];
+      }
+    }
+    lit_freqs[256] = 1;
+
+    std::vector<uint8_t> lit_lengths;
+    std::vector<uint8_t> dist_lengths;
+    buildLengths(lit_freqs, 15, lit_lengths);
+    buildLengths(dist_freqs, 15, dist_lengths);
+    if (*std::max_element(dist_lengths.begin(), dist_lengths.end()) == 0) {
+      dist_lengths[0] = 1;
+    }
+    size_t hlit = 286;
+    while (hlit > 257 && lit_lengths[hlit - 1] == 0) {
+      hlit--;
+    }
+    size_t hdist = 30;
+    while (hdist > 1 && dist_lengths[hdist - 1] == 0) {
+      hdist--;
+    }
+
+    //run length encoded code lengths: symbol and its extra bits value
+    std::vector<uint8_t> all_lengths(lit_lengths.begin(), lit_lengths.begin() + hlit);
+    all_lengths.insert(all_lengths.end(), dist_lengths.begin(), dist_lengths.begin() + hdist);
+    std::vector<std::pair<uint8_t, uint8_t>> rle;
+    for (size_t i = 0; i < all_lengths.size();) {
+      uint8_t len = all_lengths[i];
+      size_t run = 1;
+      while (i + run < all_lengths.size() && all_lengths[i + run] == len) {
+        run++;
+      }
+      if (len == 0 && run >= 11) {
+        run = std::min(run, (size_t) 138);
+        rle.emplace_back(18, run - 11);
+      } else if (len == 0 && run >= 3) {
+        rle.emplace_back(17, run - 3);
+      } else if (len != 0 && run >= 4) {
+        run = std::min(run, (size_t) 7);
+        rle.emplace_back(len, 0);
+        rle.emplace_back(16, run - 4);
+      } else {
+        run = 1;
+        rle.emplace_back(len, 0);
+      }
+      i += run;
+    }
+    std::vector<uint32_t> cl_freqs(19, 0);
+    for (auto& p : rle) {
+      cl_freqs[p.first]++;
+    }
+    std::vector<uint8_t> cl_lengths;
+    buildLengths(cl_freqs, 7, cl_lengths);
+    size_t hclen = 19;
+    while (hclen > 4 && cl_lengths[CODE_LENGTH_ORDER[hclen - 1]] == 0) {
+      hclen--;
+    }
+
+    size_t dynamic_bits = 3 + 14 + hclen * 3 + extra_bits;
+    for (auto& p : rle) {
+      dynamic_bits += cl_lengths[p.first] + (p.first == 16 ? 2 : p.first == 17 ? 3 : p.first == 18 ? 7 : 0);
+    }
+    size_t fixed_bits = 3 + extra_bits;
+    for (size_t i = 0; i < 286; ++i) {
+      dynamic_bits += (size_t) lit_freqs[i] * lit_lengths[i];
+      fixed_bits += (size_t) lit_freqs[i] * fixedLitLength(i);
+    }
+    for (size_t i = 0; i < 30; ++i) {
+      dynamic_bits += (size_t) dist_freqs[i] * dist_lengths[i];
+      fixed_bits += (size_t) dist_freqs[i] * 5;
+    }
+    size_t raw_len = block_end - block_start;
+    size_t stored_bits = (raw_len + 5 * (raw_len / MAX_STORED_BLOCK + 1)) * 8 + 7;
+
+    if (stored_bits <= std::min(dynamic_bits, fixed_bits)) {
+      writeStored(block_start, block_end, final);
+    } else if (fixed_bits <= dynamic_bits) {
+      std::vector<uint8_t> fixed_lit(288);
+      std::vector<uint8_t> fixed_dist(30, 5);
+      for (size_t i = 0; i < 288; ++i) {
+        fixed_lit[i] = fixedLitLength(i);
+      }
+      writer.write(final ? 1 : 0, 1);
+      writer.write(1, 2);
+      writeSymbols(fixed_lit, fixed_dist);
+    } else {
+      writer.write(final ? 1 : 0, 1);
+      writer.write(2, 2);
+      writer.write(hlit - 257, 5);
+      writer.write(hdist - 1, 5);
+      writer.write(hclen - 4, 4);
+      for (size_t i = 0; i < hclen; ++i) {
+        writer.write(cl_lengths[CODE_LENGTH_ORDER[i]], 3);
+      }
+      std::vector<uint16_t> cl_codes;
+      buildCodes(cl_lengths, cl_codes);
+      for (auto& p : rle) {
+        writer.write(cl_codes[p.first], cl_lengths[p.first]);
+        if (p.first == 16) {
+          writer.write(p.second, 2);
+        } else if (p.first == 17) {
+          writer.write(p.second, 3);
+        } else if (p.first == 18) {
+          writer.write(p.second, 7);
+        }
+      }
+      writeSymbols(lit_lengths, dist_lengths);
+    }
+    symbols.clear();
+    block_start = block_end;
+  }
+
+  static uint8_t fixedLitLength(size_t symbol) {
+    if (symbol < 144) return 8;
+    if (symbol < 256) return 9;
+    if (symbol < 280) return 7;
+    return 8;
+  }
+
+  void writeSymbols(const std::vector<uint8_t>& lit_lengths, const std::vector<uint8_t>& dist_lengths) {
+    std::vector<uint16_t> lit_codes;
+    std::vector<uint16_t> dist_codes;
+    buildCodes(lit_lengths, lit_codes);
+    buildCodes(dist_lengths, dist_codes);
+    for (const LzSymbol& s : symbols) {
+      if (s.length == 0) {
+        writer.write(lit_codes[s.value], lit_lengths[s.value]);
+      } else {
+        size_t lcode = findCode(LENGTH_BASE, 29, s.length);
+        size_t dcode = findCode(DIST_BASE, 30, s.value);
+        writer.write(lit_codes[257 + lcode], lit_lengths[257 + lcode]);
+        writer.write(s.length - LENGTH_BASE[lcode], LENGTH_EXTRA[lcode]);
+        writer.write(dist_codes[dcode], dist_lengths[dcode]);
+        writer.write(s.value - DIST_BASE[dcode], DIST_EXTRA[dcode]);
+      }
+    }
+    writer.write(lit_codes[256], lit_lengths[256]);
+  }
+
+  const uint8_t* data;
+  size_t dict_start;
+  size_t start;
+  size_t end;
+  const CompressionLevel& level;
+  bool last;
+  BitWriter& writer;
+  std::vector<int32_t> head;
+  std::vector<int32_t> prev;
+  size_t next_insert;
+  size_t block_start;
+  std::vector<LzSymbol> symbols;
+};
+
+inline uint8_t paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = std::abs(p - a);
+  int pb = std::abs(p - b);
+  int pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc) return (uint8_t) a;
+  if (pb <= pc) return (uint8_t) b;
+  return (uint8_t) c;
+}
+
+//writes filter type byte and filtered row, picking the filter with the lowest sum of absolute differences
+void filterRow(const uint8_t* row, const uint8_t* prev_row, size_t row_bytes, bool adaptive, uint8_t* out) {
+  const size_t bpp = 4;
+  if (!adaptive) {
+    out[0] = 0;
+    std::copy(row, row + row_bytes, out + 1);
+    return;
+  }
+  std::vector<uint8_t> candidate(row_bytes);
+  size_t best_sum = (size_t) -1;
+  for (uint8_t type = 0; type < 5; ++type) {
+    size_t sum = 0;
+    for (size_t i = 0; i < row_bytes; ++i) {
+      int a = i >= bpp ? row[i - bpp] : 0;
+      int b = prev_row ? prev_row[i] : 0;
+      int c = (prev_row && i >= bpp) ? prev_row[i - bpp] : 0;
+      uint8_t value;
+      switch (type) {
+        case 1: value = (uint8_t) (row[i] - a); break;
+        case 2: value = (uint8_t) (row[i] - b); break;
+        case 3: value = (uint8_t) (row[i] - ((a + b) >> 1)); break;
+        case 4: value = (uint8_t) (row[i] - paeth(a, b, c)); break;
+        default: value = row[i]; break;
+      }
+      candidate[i] = value;
+      sum += (size_t) std::abs((int8_t) value);
+    }
+    if (sum < best_sum) {
+      best_sum = sum;
+      out[0] = type;
+      std::copy(candidate.begin(), candidate.end(), out + 1);
+    }
+  }
+}
+
+void appendBigEndian(std::vector<uint8_t>& out, uint32_t value) {
+  out.push_back((uint8_t) (value >> 24));
+  out.push_back((uint8_t) (value >> 16));
+  out.push_back((uint8_t) (value >> 8));
+  out.push_back((uint8_t) value);
+}
+
+void appendChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t len) {
+  appendBigEndian(out, (uint32_t) len);
+  size_t type_pos = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data, data + len);
+  appendBigEndian(out, crc32(0, out.data() + type_pos, len + 4));
+}
+
+}
+
+std::vector<uint8_t> encodePng(size_t width, size_t height, const uint32_t* data,
+                               PngCompression compression, size_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  const CompressionLevel& level = LEVELS[compression];
+  size_t row_bytes = width * 4;
+  size_t rows_per_band = std::max((size_t) 1, BAND_BYTES / (row_bytes + 1));
+  size_t num_bands = (height + rows_per_band - 1) / rows_per_band;
+  std::vector<uint8_t> filtered(height * (row_bytes + 1));
+  std::vector<uint32_t> band_adler(num_bands);
+
+  parallelFor(num_bands, num_threads, [&](size_t band) {
+    TraceScope trace("filter band", "png", "band", band);
+    size_t row_begin = band * rows_per_band;
+    size_t row_end = std::min(height, row_begin + rows_per_band);
+    for (size_t y = row_begin; y < row_end; ++y) {
+      const uint8_t* row = (const uint8_t*) (data + y * width);
+      const uint8_t* prev_row = y > 0 ? (const uint8_t*) (data + (y - 1) * width) : nullptr;
+      filterRow(row, prev_row, row_bytes, level.max_chain > 0, filtered.data() + y * (row_bytes + 1));
+    }
+    band_adler[band] = adler32(1, filtered.data() + row_begin * (row_bytes + 1),
+                               (row_end - row_begin) * (row_bytes + 1));
+  });
+
+  uint32_t adler = 1;
+  for (size_t band = 0; band < num_bands; ++band) {
+    size_t band_rows = std::min(height, (band + 1) * rows_per_band) - band * rows_per_band;
+    adler = adler32Combine(adler, band_adler[band], band_rows * (row_bytes + 1));
+  }
+
+  //bands are deflated independently, previous band's data is used as dictionary, each becomes an IDAT chunk
+  std::vector<std::vector<uint8_t>> band_chunks(num_bands);
+  parallelFor(num_bands, num_threads, [&](size_t band) {
+    TraceScope trace("deflate band", "png", "band", band);
+    size_t start = band * rows_per_band * (row_bytes + 1);
+    size_t end = std::min(height, (band + 1) * rows_per_band) * (row_bytes + 1);
+    size_t dict_start = start > WINDOW_SIZE ? start - WINDOW_SIZE : 0;
+    bool last = band + 1 == num_bands;
+    std::vector<uint8_t> compressed;
+    if (band == 0) {
+      compressed.push_back(0x78);
+      compressed.push_back(ZLIB_LEVEL_FLAGS[compression]);
+    }
+    BitWriter writer(compressed);
+    BandDeflater(filtered.data(), dict_start, start, end, level, last, writer).run();
+    writer.align();
+    if (last) {
+      appendBigEndian(compressed, adler);
+    }
+    appendChunk(band_chunks[band], "IDAT", compressed.data(), compressed.size());
+  });
+
+  std::vector<uint8_t> result = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  std::vector<uint8_t> header;
+  appendBigEndian(header, (uint32_t) width);
+  appendBigEndian(header, (uint32_t) height);
+  //8 bits per sample, RGBA, deflate, adaptive filtering, no interlace
+  header.insert(header.end(), {8, 6, 0, 0, 0});
+  appendChunk(result, "IHDR", header.data(), header.size());
+  for (auto& chunk : band_chunks) {
+    result.insert(result.end(), chunk.begin(), chunk.end());
+  }
+  appendChunk(result, "IEND", nullptr, 0);
+  return result;
+}
+
+bool writePng(const std::string& filename, size_t width, size_t height, const uint32_t* data,
+              PngCompression compression, size_t num_threads) {
+  std::vector<uint8_t> png = encodePng(width, height, data, compression, num_threads);
+  std::ofstream ofs(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!ofs.is_open()) {
+    return false;
+  }
+  ofs.write((const char*) png.data(), png.size());
+  ofs.close();
+  return ofs.good();
+}
@@ -0,0 +1,22 @@
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum PngCompression {
+  PNG_STORE = 0, PNG_FAST = 1, PNG_DEFAULT = 2, PNG_MAX = 3
+};
+
+//encodes RGBA pixels into png file contents, rows are split into bands which are filtered and deflated in parallel,
+//every band is written as a separate IDAT chunk of one zlib stream
+//num_threads: 0 means hardware concurrency
+std::vector<uint8_t> encodePng(size_t width, size_t height, const uint32_t* data,
+                               PngCompression compression = PNG_DEFAULT, size_t num_threads = 0);
+
+bool writePng(const std::string& filename, size_t width, size_t height, const uint32_t* data,
+              PngCompression compression = PNG_DEFAULT, size_t num_threads = 0);
+
+#endif
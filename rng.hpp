@@ -0,0 +1,156 @@
+#ifndef NEBULABROTGEN_RNG_HPP
+#define NEBULABROTGEN_RNG_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+
+//generators of uniform doubles in [0, 1) for the sampler, filled in batches ahead of use
+//a generator provides seed(uint64_t) and fill(double* out, size_t count), count being a multiple of 8
+//compiled per instruction set together with the renderer, see stdcomplexrenderer.hpp
+#ifdef NEBULABROTGEN_KERNELS
+namespace NEBULABROTGEN_KERNELS {
+#endif
+
+inline uint64_t splitMix64(uint64_t& state) {
+  uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+//52 random bits as the mantissa of a double in [1, 2), minus one
+inline double uniformFromBits(uint64_t bits) {
+  uint64_t mantissa = (bits >> 12) | 0x3ff0000000000000ull;
+  double result;
+  std::memcpy(&result, &mantissa, sizeof(double));
+  return result - 1.0;
+}
+
+//xoshiro256+ streams advanced in lockstep, one per lane, so filling a batch vectorizes
+class XoshiroGenerator {
+public:
+  static const size_t LANES = 8;
+
+  void seed(uint64_t seed) {
+    for (size_t j = 0; j < 4; ++j) {
+      for (size_t l = 0; l < LANES; ++l) {
+        state[j][l] = splitMix64(seed);
+      }
+    }
+  }
+
+  void fill(double* out, size_t count) {
+    uint64_t s0[LANES], s1[LANES], s2[LANES], s3[LANES];
+    std::memcpy(s0, state[0], sizeof(s0));
+    std::memcpy(s1, state[1], sizeof(s1));
+    std::memcpy(s2, state[2], sizeof(s2));
+    std::memcpy(s3, state[3], sizeof(s3));
+    for (size_t i = 0; i < count; i += LANES) {
+      for (size_t l = 0; l < LANES; ++l) {
+        uint64_t result = s0[l] + s3[l];
+        uint64_t t = s1[l] << 17;
+        s2[l] ^= s0[l];
+        s3[l] ^= s1[l];
+        s1[l] ^= s2[l];
+        s0[l] ^= s3[l];
+        s2[l] ^= t;
+        s3[l] = (s3[l] << 45) | (s3[l] >> 19);
+        out[i + l] = uniformFromBits(result);
+      }
+    }
+    std::memcpy(state[0], s0, sizeof(s0));
+    std::memcpy(state[1], s1, sizeof(s1));
+    std::memcpy(state[2], s2, sizeof(s2));
+    std::memcpy(state[3], s3, sizeof(s3));
+  }
+
+private:
+  uint64_t state[4][LANES];
+};
+
+//counter-based philox4x32-10, the stream is a function of the key alone, which is what deterministic renders seed
+//with a hash of (seed, channel, job); every block of the counter gives two doubles
+class PhiloxGenerator {
+public:
+  void seed(uint64_t seed) {
+    key0 = (uint32_t) seed;
+    key1 = (uint32_t) (seed >> 32);
+    counter = 0;
+  }
+
+  void fill(double* out, size_t count) {
+    for (size_t i = 0; i < count; i += 2) {
+      uint64_t block = counter + i / 2;
+      uint32_t c0 = (uint32_t) block, c1 = (uint32_t) (block >> 32), c2 = 0, c3 = 0;
+      uint32_t k0 = key0, k1 = key1;
+      for (int round = 0; round < 10; ++round) {
+        uint64_t p0 = (uint64_t) 0xd2511f53u * c0;
+        uint64_t p1 = (uint64_t) 0xcd9e8d57u * c2;
+        uint32_t n0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t) p1;
+        c3 = (uint32_t) p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += 0x9e3779b9u;
+        k1 += 0xbb67ae85u;
+      }
+      out[i] = uniformFromBits(((uint64_t) c1 << 32) | c0);
+      out[i + 1] = uniformFromBits(((uint64_t) c3 << 32) | c2);
+    }
+    counter += count / 2;
+  }
+
+private:
+  uint32_t key0 = 0, key1 = 0;
+  uint64_t counter = 0;
+};
+
+//the generator used before batches were introduced
+class Mt19937Generator {
+public:
+  void seed(uint64_t seed) {
+    random.seed((std::mt19937::result_type) (seed ^ (seed >> 32)));
+  }
+
+  void fill(double* out, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      out[i] = random() / (std::mt19937::max() + 1.0);
+    }
+  }
+
+private:
+  std::mt19937 random;
+};
+
+template<typename generator_t>
+class UniformSource {
+public:
+  static const size_t BATCH_SIZE = 256;
+
+  void seed(uint64_t seed) {
+    generator.seed(seed);
+    next = BATCH_SIZE;
+  }
+
+  double operator()() {
+    if (next == BATCH_SIZE) {
+      generator.fill(batch, BATCH_SIZE);
+      next = 0;
+    }
+    return batch[next++];
+  }
+
+private:
+  generator_t generator;
+  double batch[BATCH_SIZE];
+  size_t next = BATCH_SIZE;
+};
+
+#ifdef NEBULABROTGEN_KERNELS
+}
+#endif
+
+#endif
@@ -11,29 +11,61 @@
 #include <iostream>
 #include <chrono>
 #include <random>
+#include <atomic>
 #include <thread>
 #include <complex>
+#include "kernels.h"
+#include "rng.hpp"
 
-const double RANDOM_MAX = std::mt19937::max();
+//kernels.cpp compiles the renderer once per instruction set, each copy in its own namespace
+#ifdef NEBULABROTGEN_KERNELS
+namespace NEBULABROTGEN_KERNELS {
+#endif
 
-template<typename real_t>
+//iterations of an orbit costing as much as storing one of its on-screen points (about a fifth measured for
+//z * z + c in double), see runChain
+const double RECOMPUTE_ITERATIONS_PER_STORE = 0.2;
+
+//real_t: float, double or DoubleDouble, only orbits and points are computed in it, sampler decisions in double
+//generator_t: source of uniforms, see rng.hpp
+template<typename real_t, typename generator_t = XoshiroGenerator>
 class BuddhabrotRenderer {
 public:
+  typedef real_t real_type;
+
   BuddhabrotRenderer(size_t width, size_t height, size_t max_iter, size_t init_points,
-                     void(* func)(std::complex<real_t>&, std::complex<real_t>), real_t random_radius, real_t norm_limit)
+                     void(* func)(std::complex<real_t>&, std::complex<real_t>), double random_radius, real_t norm_limit)
       : width(width), height(height), max_iter(max_iter), init_points(init_points), norm_limit(norm_limit),
         rand_min(-random_radius), rand_offset(2 * random_radius),
-        orbit_x(max_iter), orbit_y(max_iter), initial(init_points), func(func) {
-    std::hash<std::thread::id> hasher;
-    random.seed(hasher(std::this_thread::get_id()));
+        estimator(SPLAT_ACCEPTED), store_orbits(true), stored_points(0), splatted_iterations(0), orbit_x(max_iter),
+        orbit_y(max_iter), state_x(max_iter), state_y(max_iter), initial(init_points), func(func) {
+    random.seed(nextRendererSeed());
+    setMutation(MutationParameters());
   }
 
   void setArea(real_t xmid, real_t ymid, real_t factor) {
-    this->diff = {width * factor * 2.0 / (width + height), height * factor * 2.0 / (width + height)};
+    this->diff = {(real_t) (width * 2.0) * factor / (real_t) (width + height),
+                  (real_t) (height * 2.0) * factor / (real_t) (width + height)};
     this->mid = {xmid, ymid};
-    this->beg = mid - diff * 0.5;
+    this->beg = mid - diff * (real_t) 0.5;
     this->end = beg + diff;
     this->factor = factor;
+    this->size = {(real_t) width, (real_t) height};
+    this->last_pixel = {(real_t) (width - 1), (real_t) (height - 1)};
+  }
+
+  void setSplatEstimator(SplatEstimator estimator) {
+    this->estimator = estimator;
+  }
+
+  void setMutation(const MutationParameters& mutation) {
+    this->mutation = mutation;
+    configured_mutation = mutation;
+    move_log_ratio = std::log(mutation.move_max / mutation.move_min);
+  }
+
+  const MutationParameters& getMutation() const {
+    return mutation;
   }
 
   void prepareInitialPoints() {
@@ -43,92 +75,302 @@ public:
     }
   }
 
+  void tuneMutation() {
+    tuneChains(0, init_points);
+  }
+
+  //computes a single orbit of c, returns the number of iterations done
+  size_t orbitIterations(std::complex<real_t> c) {
+    computeOrbit<ORBIT_STORE>(c);
+    return curr_iter;
+  }
+
+  const RendererStats& getStats() const {
+    return stats;
+  }
+
+  void resetStats() {
+    stats = RendererStats();
+  }
+
   void outputPointValues(uint32_t* out, size_t iterations) {
     for (size_t i = 0; i < init_points; ++i) {
-      computeOrbit(0, initial[i]);
-      for (size_t k = 0; k < curr_on_screen; ++k) {
-        ++out[orbit_y[k] * width + orbit_x[k]];
+      runChain(out, i, iterations);
+    }
+  }
+
+  //independent of the renderer's previous state: every chain seeds the generator with a hash of key and its index,
+  //finds its initial point and runs iterations proposals
+  void outputSeededPointValues(uint32_t* out, size_t iterations, uint64_t key) {
+    for (size_t i = 0; i < init_points; ++i) {
+      uint64_t chain_key = key ^ (i * 0x9e3779b97f4a7c15ull);
+      random.seed(splitMix64(chain_key));
+      do {
+      } while (!findInitialPointAttempt(initial[i]));
+      //every chain tunes from the configured parameters, independent of the others
+      mutation = configured_mutation;
+      tuneChains(i, i + 1);
+      runChain(out, i, iterations);
+    }
+  }
+
+private:
+  //what computeOrbit does with on-screen points: only counts them, stores their pixels in orbit_x and orbit_y, or
+  //adds them to the counts directly
+  enum OrbitOutput {
+    ORBIT_COUNT, ORBIT_STORE, ORBIT_SPLAT
+  };
+
+  void runChain(uint32_t* out, size_t i, size_t iterations) {
+    //most proposals are rejected, storing their on-screen points is wasted when they are many (long orbits in the
+    //view); store-free evaluation only counts them and iterates splatted orbits again, which is chosen when that
+    //was cheaper for the proposals so far
+    store_orbits = stored_points * RECOMPUTE_ITERATIONS_PER_STORE <= splatted_iterations;
+    startChain(i);
+    if (mutation.adaptive) {
+      runStateChain(out, i, iterations);
+      return;
+    }
+    //the initial point counts as accepted
+    outputOrbit(out, initial[i], estimator == SPLAT_EXPECTED ? SPLAT_WEIGHT_SCALE : 1);
+    for (size_t j = 0; j < iterations; ++j) {
+
+      std::complex<real_t> x;
+      bool random_proposal, accepted;
+      double alpha = step(i, x, random_proposal, accepted);
+      if (estimator == SPLAT_EXPECTED && alpha > 0) {
+        //alpha in units of the scale, rounded up or down at random so that it stays unbiased
+        uint32_t weight = static_cast<uint32_t>(alpha * SPLAT_WEIGHT_SCALE + uniform());
+        if (weight > 0) {
+          splatted_iterations += curr_iter;
+          outputOrbit(out, x, weight);
+        }
+      }
+      if (accepted && estimator == SPLAT_ACCEPTED) {
+        splatted_iterations += curr_iter;
+        outputOrbit(out, x, 1);
       }
+    }
+  }
+
+  //chains with tuned proposals count their state after every proposal instead of the accepted proposals (expected:
+  //the proposal weighted by its acceptance probability and the state by the rest), see MutationParameters; a state
+  //is splatted when the chain leaves it, weighted by the proposals it stayed for
+  void runStateChain(uint32_t* out, size_t i, size_t iterations) {
+    double holding = 0;
+    keepState();
+    for (size_t j = 0; j < iterations; ++j) {
+
+      std::complex<real_t> state = initial[i];
+      std::complex<real_t> x;
+      bool random_proposal, accepted;
+      double alpha = step(i, x, random_proposal, accepted);
+      if (estimator == SPLAT_EXPECTED) {
+        if (alpha > 0) {
+          uint32_t weight = static_cast<uint32_t>(alpha * SPLAT_WEIGHT_SCALE + uniform());
+          if (weight > 0) {
+            splatted_iterations += curr_iter;
+            outputOrbit(out, x, weight);
+          }
+        }
+        holding += 1.0 - alpha;
+      }
+      if (accepted) {
+        outputState(out, state, holding);
+        holding = 0;
+        keepState();
+      }
+      if (estimator == SPLAT_ACCEPTED) {
+        holding += 1.0;
+      }
+    }
+    outputState(out, initial[i], holding);
+  }
+
+  //the orbit evaluated last becomes the chain's state, its pixels are kept only while orbits are stored
+  void keepState() {
+    state_iter = curr_iter;
+    if (store_orbits) {
+      std::copy(orbit_x.begin(), orbit_x.begin() + curr_on_screen, state_x.begin());
+      std::copy(orbit_y.begin(), orbit_y.begin() + curr_on_screen, state_y.begin());
+      state_on_screen = curr_on_screen;
+    }
+  }
+
+  //splats the orbit of state c held for the given number of proposals, see outputOrbit
+  void outputState(uint32_t* out, std::complex<real_t> c, double holding) {
+    uint32_t weight = estimator == SPLAT_EXPECTED ? static_cast<uint32_t>(holding * SPLAT_WEIGHT_SCALE + uniform())
+                                                  : static_cast<uint32_t>(holding);
+    if (weight == 0) {
+      return;
+    }
+    splatted_iterations += state_iter;
+    if (store_orbits) {
+      for (size_t k = 0; k < state_on_screen; ++k) {
+        out[state_y[k] * width + state_x[k]] += weight;
+      }
+    } else {
+      computeOrbit<ORBIT_SPLAT>(c, out, weight);
+      ++stats.recomputed;
+    }
+  }
+
+  void startChain(size_t i) {
+    evaluate(initial[i]);
+    prev_on_screen = curr_on_screen;
+    prev_iter = curr_iter;
+    prev_contrib = curr_contrib;
+  }
+
+  //one proposal x of chain i, its orbit is the one evaluated last; returns its acceptance probability, 0 if it
+  //doesn't escape or reach the view
+  double step(size_t i, std::complex<real_t>& x, bool& random_proposal, bool& accepted) {
+    x = initial[i];
+    random_proposal = mutate(x);
+    evaluate(x);
+    ++stats.proposals;
+    stored_points += curr_on_screen;
+    accepted = false;
+    if (curr_iter == max_iter) {
+      ++stats.rejected_non_escaping;
+      return 0;
+    }
+    if (curr_on_screen == 0) {
+      ++stats.rejected_off_screen;
+      return 0;
+    }
+    double alpha = acceptanceProbability(curr_contrib, curr_on_screen, prev_contrib, prev_on_screen, max_iter);
+
+    accepted = alpha > uniform();
+    if (accepted) {
       prev_on_screen = curr_on_screen;
       prev_iter = curr_iter;
       prev_contrib = curr_contrib;
-      for (size_t j = 0; j < iterations; ++j) {
-
-        std::complex<real_t> x = initial[i];
+      initial[i] = x;
+      ++stats.accepted;
+    }
+    return alpha;
+  }
 
-        mutate(x);
-        computeOrbit(0, x);
-        if (curr_iter == max_iter || curr_on_screen == 0) {
-          continue;
-        }
-        real_t t1 = transitionProbability(curr_on_screen, prev_on_screen);
-        real_t t2 = transitionProbability(prev_on_screen, curr_on_screen);
-        real_t alpha = std::min(1.0, std::exp(std::log(curr_contrib * t1) - std::log(prev_contrib * t2)));
-
-        if (alpha > ((real_t) random()) / RANDOM_MAX) {
-          prev_on_screen = curr_on_screen;
-          prev_iter = curr_iter;
-          prev_contrib = curr_contrib;
-          initial[i] = x;
-
-          for (size_t k = 0; k < curr_on_screen; ++k) {
-            ++out[orbit_y[k] * width + orbit_x[k]];
-          }
+  //burn-in of chains first to last without output or stats when the parameters are adaptive, see
+  //MutationParameters
+  void tuneChains(size_t first, size_t last) {
+    if (!mutation.adaptive) {
+      return;
+    }
+    RendererStats saved = stats;
+    uint64_t random_proposals = 0, random_accepted = 0, moves = 0, moves_accepted = 0;
+    for (size_t i = first; i < last; ++i) {
+      startChain(i);
+      for (size_t j = 0; j < mutation.burn_in; ++j) {
+
+        std::complex<real_t> x;
+        bool random_proposal, accepted;
+        step(i, x, random_proposal, accepted);
+        if (random_proposal) {
+          ++random_proposals;
+          random_accepted += accepted;
+        } else {
+          adaptMoveRadius(mutation, accepted, moves);
+          ++moves;
+          moves_accepted += accepted;
         }
       }
     }
+    if (random_proposals > 0 && moves > 0) {
+      adaptRandomFraction(mutation, (double) random_accepted / random_proposals, (double) moves_accepted / moves);
+    }
+    stats = saved;
+  }
+
+  void evaluate(std::complex<real_t> c) {
+    if (store_orbits) {
+      computeOrbit<ORBIT_STORE>(c);
+    } else {
+      computeOrbit<ORBIT_COUNT>(c);
+    }
+  }
+
+  //adds weight for each on-screen point of c, the orbit evaluated last
+  void outputOrbit(uint32_t* out, std::complex<real_t> c, uint32_t weight) {
+    if (store_orbits) {
+      for (size_t k = 0; k < curr_on_screen; ++k) {
+        out[orbit_y[k] * width + orbit_x[k]] += weight;
+      }
+    } else {
+      computeOrbit<ORBIT_SPLAT>(c, out, weight);
+      ++stats.recomputed;
+    }
   }
 
-private:
   inline real_t mapv(real_t value, real_t in_min, real_t in_diff, real_t out_min, real_t out_diff) {
     return (value - in_min) * out_diff / in_diff + out_min;
   }
 
-  real_t norm(real_t a, real_t b) {
-    return a * a + b * b;
+  double uniform() {
+    return random();
+  }
+
+  //offsets are small compared to the points they are added to, double is enough for them in every precision
+  std::complex<real_t> polarOffset(double r, double phi) {
+    return std::complex<real_t>((real_t) (r * std::cos(phi)), (real_t) (r * std::sin(phi)));
   }
 
+  //radius between factor * move_min and factor * move_max, log-uniformly
   void mutateMove(std::complex<real_t>& num) {
-    real_t r1 = factor * 0.0001;
-    real_t r2 = factor * 0.1;
-    real_t phi = (((real_t) random()) / RANDOM_MAX) * M_PI * 2.0;
-    real_t r = r2 * std::exp(-std::log(r2 / r1) * (((real_t) random()) / RANDOM_MAX));
-    num += std::polar(r, phi);
+    double r2 = (double) factor * mutation.move_max;
+    double phi = uniform() * (M_PI * 2.0);
+    double r = r2 * std::exp(-move_log_ratio * uniform());
+    num += polarOffset(r, phi);
   }
 
   void mutateRandom(std::complex<real_t>& num) {
     do {
-      num.real(mapv(((real_t) random()) / RANDOM_MAX, 0, 1, rand_min, rand_offset));
-      num.imag(mapv(((real_t) random()) / RANDOM_MAX, 0, 1, rand_min, rand_offset));
+      num.real((real_t) (rand_min + uniform() * rand_offset));
+      num.imag((real_t) (rand_min + uniform() * rand_offset));
     } while (std::norm(num) > norm_limit);
   }
 
-  void mutate(std::complex<real_t>& num) {
-    if (random() % 5) {
+  //true for a random point
+  bool mutate(std::complex<real_t>& num) {
+    if (uniform() < mutation.random_fraction) {
       mutateRandom(num);
-    } else {
-      mutateMove(num);
+      return true;
     }
+    mutateMove(num);
+    return false;
   }
 
-  real_t transitionProbability(size_t n1, size_t n2) {
-    return (1.0 - ((real_t) (max_iter - n1)) / max_iter) /
-           (1.0 - ((real_t) (max_iter - n2)) / max_iter);
-  }
-
-  void computeOrbit(std::complex<real_t> a, std::complex<real_t> add) {
+  template<OrbitOutput output>
+  void computeOrbit(std::complex<real_t> add, uint32_t* out = nullptr, uint32_t weight = 1) {
+    using std::isfinite;
+    std::complex<real_t> a;
+    //read from memory before every call, a pair of floats kept in registers across calls is packed again through
+    //the stack each time, which stalls on store forwarding
+    orbit_add = add;
     curr_on_screen = 0;
     curr_iter = 0;
     for (size_t j = 0; j < max_iter; ++j) {
 
-      func(a, add);
-      if (!std::isfinite(a.real())) {
+      func(a, orbit_add);
+      if (!isfinite(a.real())) {
         throw std::runtime_error("nan detected");
       }
 
       if (a.real() > beg.real() && a.real() < end.real() && a.imag() > beg.imag() && a.imag() < end.imag()) {
-        orbit_x[curr_on_screen] = static_cast<uint16_t>(mapv(a.real(), beg.real(), diff.real(), 0, width));
-        orbit_y[curr_on_screen] = static_cast<uint16_t>(mapv(a.imag(), beg.imag(), diff.imag(), 0, height));
+        if (output != ORBIT_COUNT) {
+          //points just inside the view can round to its far edge in float
+          uint16_t x = static_cast<uint16_t>((double) std::min(last_pixel.real(),
+                                                               mapv(a.real(), beg.real(), diff.real(), 0, size.real())));
+          uint16_t y = static_cast<uint16_t>((double) std::min(last_pixel.imag(),
+                                                               mapv(a.imag(), beg.imag(), diff.imag(), 0, size.imag())));
+          if (output == ORBIT_STORE) {
+            orbit_x[curr_on_screen] = x;
+            orbit_y[curr_on_screen] = y;
+          } else {
+            out[y * width + x] += weight;
+          }
+        }
         ++curr_on_screen;
       }
 
@@ -141,25 +383,25 @@ private:
       }
       ++curr_iter;
     }
-    curr_contrib = ((real_t) curr_on_screen) / curr_iter;
+    curr_contrib = ((double) curr_on_screen) / curr_iter;
   }
 
   bool findInitialPointAttempt(std::complex<real_t>& num) {
-    real_t rand_rad = 2;
+    double rand_rad = 2;
     int find_iter = 500, find_iter_2 = 200;
-    num = 0;
+    num = std::complex<real_t>();
     for (int i = 0; i < find_iter; ++i) {
 
-      real_t closest = 1e20;
+      double closest = 1e20;
       std::complex<real_t> next = num;
 
       for (int j = 0; j < find_iter_2; ++j) {
 
         std::complex<real_t> temp = num;
-        real_t phi = (((real_t) random()) / RANDOM_MAX) * M_PI * 2.0;
-        real_t r = (((real_t) random()) / RANDOM_MAX) * rand_rad;
-        temp += std::polar(r, phi);
-        computeOrbit(0, temp);
+        double phi = uniform() * (M_PI * 2.0);
+        double r = uniform() * rand_rad;
+        temp += polarOffset(r, phi);
+        computeOrbit<ORBIT_COUNT>(temp);
 
         if (curr_iter == max_iter) {
           continue;
@@ -170,8 +412,11 @@ private:
           return true;
         }
 
+        //the orbit again, the closest approach to the centre of the view is only needed here
+        std::complex<real_t> a;
         for (size_t k = 0; k < curr_iter; ++k) {
-          real_t dist2 = norm(orbit_x[k] - mid.real(), orbit_y[k] - mid.imag());
+          func(a, temp);
+          double dist2 = (double) std::norm(a - mid);
           if (dist2 < closest) {
             closest = dist2;
             next = temp;
@@ -187,18 +432,37 @@ private:
 
   size_t width, height, max_iter, init_points;
   std::complex<real_t> beg, end, diff, mid;
+  //width and height of the image, index of the last pixel
+  std::complex<real_t> size, last_pixel;
   real_t factor;
   real_t norm_limit;
-  real_t rand_min;
-  real_t rand_offset;
+  double rand_min;
+  double rand_offset;
   size_t curr_iter, curr_on_screen, prev_iter, prev_on_screen;
-  real_t curr_contrib, prev_contrib;
+  double curr_contrib, prev_contrib;
+  SplatEstimator estimator;
+  //evaluation of proposals, the costs of both ways so far
+  bool store_orbits;
+  uint64_t stored_points, splatted_iterations;
   std::vector<uint16_t> orbit_x;
   std::vector<uint16_t> orbit_y;
+  //pixels of the current state of an adaptive chain, while orbits are stored
+  std::vector<uint16_t> state_x;
+  std::vector<uint16_t> state_y;
+  size_t state_iter, state_on_screen;
   std::vector<std::complex<real_t>> initial;
-  std::mt19937 random;
+  std::complex<real_t> orbit_add;
+  //the parameters in use, tuned from the configured ones
+  MutationParameters mutation, configured_mutation;
+  double move_log_ratio;
+  UniformSource<generator_t> random;
+  RendererStats stats;
 
   void (* func)(std::complex<real_t>&, std::complex<real_t>);
 };
 
+#ifdef NEBULABROTGEN_KERNELS
+}
+#endif
+
 #endif //CPPPROJ_STDCOMPLEXRENDERER_H
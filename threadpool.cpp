@@ -0,0 +1,171 @@
+#include "threadpool.h"
+#include "numa.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+std::unique_ptr<ThreadPool> shared_pool;
+std::mutex shared_pool_mutex;
+//index into allowedCpus of the next pinned worker, shared by all pools
+std::atomic<size_t> next_pinned_cpu(0);
+
+//cpus of the process's affinity mask, node by node
+std::vector<int> allowedCpus() {
+  std::vector<int> cpus = NumaTopology::get().getCpusByNode();
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&set](int cpu) {
+      return cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &set);
+    }), cpus.end());
+  }
+#endif
+  return cpus;
+}
+
+void pinCurrentThread(int cpu) {
+#ifdef __linux__
+  if (cpu < 0) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void) cpu;
+#endif
+}
+
+}
+
+ThreadPool::ThreadPool(size_t num_threads, bool pin_threads) : pinned(false), stopping(false) {
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::vector<int> cpus;
+  size_t first_cpu = 0;
+  if (pin_threads) {
+    cpus = allowedCpus();
+    pinned = !cpus.empty();
+    //the unpinned caller of run() is counted as the first thread, leaving a cpu for it
+    first_cpu = next_pinned_cpu.fetch_add(num_threads);
+  }
+  //workers fill one numa node before the next
+  for (size_t i = 1; i < num_threads; ++i) {
+    int cpu = cpus.empty() ? -1 : cpus[(first_cpu + i) % cpus.size()];
+    workers.emplace_back(&ThreadPool::workerFunction, this, i, cpu);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  work_available.notify_all();
+  for (auto& th : workers) {
+    th.join();
+  }
+}
+
+size_t ThreadPool::getSize() const {
+  return workers.size() + 1;
+}
+
+bool ThreadPool::isPinned() const {
+  return pinned;
+}
+
+void ThreadPool::run(size_t num_tasks, const std::function<void(size_t)>& task) {
+  if (num_tasks == 0) {
+    return;
+  }
+  Batch batch;
+  batch.task = &task;
+  batch.num_tasks = num_tasks;
+  batch.next_task = 0;
+  batch.finished_tasks = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  if (num_tasks > 1) {
+    batches.push_back(&batch);
+    if (num_tasks - 1 >= workers.size()) {
+      work_available.notify_all();
+    } else {
+      for (size_t i = 1; i < num_tasks; ++i) {
+        work_available.notify_one();
+      }
+    }
+  }
+  size_t task_num;
+  while (claimTask(batch, task_num)) {
+    lock.unlock();
+    task(task_num);
+    lock.lock();
+    finishTask(batch);
+  }
+  batch_finished.wait(lock, [&]() { return batch.finished_tasks == batch.num_tasks; });
+}
+
+ThreadPool& ThreadPool::shared() {
+  std::lock_guard<std::mutex> lock(shared_pool_mutex);
+  if (!shared_pool) {
+    shared_pool.reset(new ThreadPool());
+  }
+  return *shared_pool;
+}
+
+void ThreadPool::setSharedSize(size_t num_threads, bool pin_threads) {
+  std::lock_guard<std::mutex> lock(shared_pool_mutex);
+  shared_pool.reset(new ThreadPool(num_threads, pin_threads));
+}
+
+void ThreadPool::workerFunction(size_t thread_num, int cpu) {
+  pinCurrentThread(cpu);
+  Trace::setThreadName("pool worker " + std::to_string(thread_num));
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    work_available.wait(lock, [this]() { return stopping || !batches.empty(); });
+    if (stopping) {
+      return;
+    }
+    Batch& batch = *batches.front();
+    size_t task_num;
+    if (claimTask(batch, task_num)) {
+      lock.unlock();
+      (*batch.task)(task_num);
+      lock.lock();
+      finishTask(batch);
+    }
+  }
+}
+
+bool ThreadPool::claimTask(Batch& batch, size_t& task_num) {
+  if (batch.next_task >= batch.num_tasks) {
+    return false;
+  }
+  task_num = batch.next_task++;
+  if (batch.next_task == batch.num_tasks) {
+    auto it = std::find(batches.begin(), batches.end(), &batch);
+    if (it != batches.end()) {
+      batches.erase(it);
+    }
+  }
+  return true;
+}
+
+void ThreadPool::finishTask(Batch& batch) {
+  batch.finished_tasks++;
+  if (batch.finished_tasks == batch.num_tasks) {
+    batch_finished.notify_all();
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+//long-lived worker threads shared by all stages, the thread calling run() also works on its tasks,
+//so runs can be nested or issued from several threads at once without deadlocking; that thread is never pinned
+class ThreadPool {
+public:
+  //num_threads: threads doing work including the caller of run(), 0 means hardware concurrency
+  //pin_threads: bind every worker to one cpu (linux only), cpus are taken node by node among the ones the process
+  //may run on (sched_getaffinity), each pinned pool continuing where the previous one stopped, so pools of one
+  //process don't stack onto the same cpus; other processes are only kept apart by their affinity masks (taskset)
+  explicit ThreadPool(size_t num_threads = 0, bool pin_threads = false);
+  ThreadPool(const ThreadPool& other) = delete;
+  ThreadPool& operator=(const ThreadPool& other) = delete;
+  ~ThreadPool();
+
+  size_t getSize() const;
+  //true if the workers are bound to cpus, false when pinning was asked for but no cpus are known
+  bool isPinned() const;
+  //calls task(i) for every i < num_tasks and returns when all calls are done
+  void run(size_t num_tasks, const std::function<void(size_t)>& task);
+
+  //pool used by the rendering managers unless they are given another one, created on first use
+  static ThreadPool& shared();
+  //replaces the shared pool, must not be called while it is running anything
+  static void setSharedSize(size_t num_threads, bool pin_threads = false);
+
+private:
+  struct Batch {
+    const std::function<void(size_t)>* task;
+    size_t num_tasks;
+    size_t next_task;
+    size_t finished_tasks;
+  };
+
+  void workerFunction(size_t thread_num, int cpu);
+  //takes the next task of the batch, must be called with the mutex locked
+  bool claimTask(Batch& batch, size_t& task_num);
+  void finishTask(Batch& batch);
+
+  std::vector<std::thread> workers;
+  std::deque<Batch*> batches;
+  std::mutex mutex;
+  std::condition_variable work_available;
+  std::condition_variable batch_finished;
+  bool pinned;
+  bool stopping;
+};
+
+#endif
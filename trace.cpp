@@ -0,0 +1,194 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> Trace::enabled(false);
+
+namespace {
+
+enum EventType {
+  EVENT_COMPLETE, EVENT_INSTANT, EVENT_COUNTER
+};
+
+struct TraceEvent {
+  const char* name;
+  const char* category;
+  const char* arg_name;
+  int64_t arg;
+  uint64_t begin;
+  uint64_t end;
+  EventType type;
+};
+
+//written by its own thread and read only when saving, so the mutex is practically never contended
+//events are allocated on the first recorded event, threads that only got a name cost nothing
+struct ThreadTrace {
+  std::mutex mutex;
+  std::vector<TraceEvent> events;
+  size_t next = 0;
+  bool wrapped = false;
+  size_t tid = 0;
+  std::string name;
+};
+
+std::mutex registry_mutex;
+std::vector<std::shared_ptr<ThreadTrace>> registry;
+std::atomic<size_t> events_per_thread(1 << 16);
+thread_local std::shared_ptr<ThreadTrace> current_thread;
+
+const std::chrono::steady_clock::time_point& clockStart() {
+  static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  return start;
+}
+
+//registered on the first event, buffers outlive their threads so events of finished threads are saved too
+ThreadTrace& threadTrace() {
+  if (!current_thread) {
+    current_thread = std::make_shared<ThreadTrace>();
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    current_thread->tid = registry.size();
+    registry.push_back(current_thread);
+  }
+  return *current_thread;
+}
+
+void record(const TraceEvent& event) {
+  ThreadTrace& thread = threadTrace();
+  std::lock_guard<std::mutex> lock(thread.mutex);
+  if (thread.events.empty()) {
+    thread.events.resize(events_per_thread);
+  }
+  thread.events[thread.next] = event;
+  thread.next++;
+  if (thread.next == thread.events.size()) {
+    thread.next = 0;
+    thread.wrapped = true;
+  }
+}
+
+std::string jsonString(const std::string& str) {
+  std::string result = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if ((unsigned char) c >= 0x20) {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+void writeEvent(std::ostream& os, const TraceEvent& event, size_t tid) {
+  os<<"{\"name\": "<<jsonString(event.name)<<", \"cat\": "<<jsonString(event.category)
+    <<", \"pid\": 1, \"tid\": "<<tid<<", \"ts\": "<<event.begin / 1000.0;
+  switch (event.type) {
+    case EVENT_COMPLETE:
+      os<<", \"ph\": \"X\", \"dur\": "<<(event.end - event.begin) / 1000.0;
+      break;
+    case EVENT_INSTANT:
+      os<<", \"ph\": \"i\", \"s\": \"t\"";
+      break;
+    case EVENT_COUNTER:
+      os<<", \"ph\": \"C\"";
+      break;
+  }
+  if (event.arg_name) {
+    os<<", \"args\": {"<<jsonString(event.arg_name)<<": "<<event.arg<<"}";
+  }
+  os<<"}";
+}
+
+}
+
+void Trace::enable(size_t num_events) {
+  clockStart();
+  events_per_thread = std::max((size_t) 1, num_events);
+  enabled = true;
+}
+
+void Trace::disable() {
+  enabled = false;
+}
+
+void Trace::clear() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (auto& thread : registry) {
+    std::lock_guard<std::mutex> thread_lock(thread->mutex);
+    std::vector<TraceEvent>().swap(thread->events);
+    thread->next = 0;
+    thread->wrapped = false;
+  }
+}
+
+bool Trace::save(const std::string& filename) {
+  std::ofstream fs(filename);
+  if (!fs.is_open()) {
+    std::cout<<"Unable to open trace file: "<<filename<<"\n";
+    return false;
+  }
+  fs<<"{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  bool first = true;
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (auto& thread : registry) {
+    std::lock_guard<std::mutex> thread_lock(thread->mutex);
+    if (!thread->name.empty()) {
+      fs<<(first ? "" : ",\n")<<"{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "<<thread->tid
+        <<", \"args\": {\"name\": "<<jsonString(thread->name)<<"}}";
+      first = false;
+    }
+    size_t count = thread->wrapped ? thread->events.size() : thread->next;
+    size_t start = thread->wrapped ? thread->next : 0;
+    for (size_t i = 0; i < count; ++i) {
+      fs<<(first ? "" : ",\n");
+      writeEvent(fs, thread->events[(start + i) % thread->events.size()], thread->tid);
+      first = false;
+    }
+  }
+  fs<<"\n]}\n";
+  if (!fs.good()) {
+    std::cout<<"Error while writing trace file: "<<filename<<"\n";
+    return false;
+  }
+  return true;
+}
+
+void Trace::setThreadName(const std::string& name) {
+  ThreadTrace& thread = threadTrace();
+  std::lock_guard<std::mutex> lock(thread.mutex);
+  thread.name = name;
+}
+
+uint64_t Trace::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - clockStart()).count();
+}
+
+void Trace::complete(const char* name, const char* category, uint64_t begin, uint64_t end,
+                     const char* arg_name, int64_t arg) {
+  if (!isEnabled()) {
+    return;
+  }
+  record({name, category, arg_name, arg, begin, end, EVENT_COMPLETE});
+}
+
+void Trace::instant(const char* name, const char* category, const char* arg_name, int64_t arg) {
+  if (!isEnabled()) {
+    return;
+  }
+  uint64_t time = now();
+  record({name, category, arg_name, arg, time, time, EVENT_INSTANT});
+}
+
+void Trace::counter(const char* name, const char* category, int64_t value) {
+  if (!isEnabled()) {
+    return;
+  }
+  uint64_t time = now();
+  record({name, category, name, value, time, time, EVENT_COUNTER});
+}
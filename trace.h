@@ -0,0 +1,60 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//timeline of events recorded per thread into ring buffers, saved as chrome trace json (chrome://tracing, perfetto)
+//recording is off until enable() is called, a disabled event costs one relaxed atomic load
+//names, categories and argument names must be string literals, only the pointers are stored
+class Trace {
+public:
+  //num_events: ring buffer size of every thread, the oldest events are overwritten when it's full
+  static void enable(size_t num_events = 1 << 16);
+  static void disable();
+  static bool isEnabled() {
+    return enabled.load(std::memory_order_relaxed);
+  }
+  //drops all recorded events
+  static void clear();
+  static bool save(const std::string& filename);
+
+  //shown instead of the thread number in the timeline, applies to the calling thread
+  static void setThreadName(const std::string& name);
+  //nanoseconds since the first use of the trace clock
+  static uint64_t now();
+  static void complete(const char* name, const char* category, uint64_t begin, uint64_t end,
+                       const char* arg_name = nullptr, int64_t arg = 0);
+  static void instant(const char* name, const char* category, const char* arg_name = nullptr, int64_t arg = 0);
+  static void counter(const char* name, const char* category, int64_t value);
+
+private:
+  static std::atomic<bool> enabled;
+};
+
+//records the lifetime of the object as one event, if tracing was enabled when it was created
+class TraceScope {
+public:
+  TraceScope(const char* name, const char* category, const char* arg_name = nullptr, int64_t arg = 0)
+      : active(Trace::isEnabled()), name(name), category(category), arg_name(arg_name), arg(arg),
+        begin(active ? Trace::now() : 0) {}
+  TraceScope(const TraceScope& other) = delete;
+  TraceScope& operator=(const TraceScope& other) = delete;
+  ~TraceScope() {
+    if (active) {
+      Trace::complete(name, category, begin, Trace::now(), arg_name, arg);
+    }
+  }
+
+private:
+  bool active;
+  const char* name;
+  const char* category;
+  const char* arg_name;
+  int64_t arg;
+  uint64_t begin;
+};
+
+#endif
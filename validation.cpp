@@ -0,0 +1,141 @@
+#include "validation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <vector>
+
+namespace {
+
+const size_t VALUE_BINS = 256;
+//block sums above this multiple of the mean fall into the last bin
+const double VALUE_RANGE = 16.0;
+
+std::vector<double> blockSums(const uint32_t* data, size_t width, size_t height, size_t block_size) {
+  size_t blocks_x = (width + block_size - 1) / block_size;
+  size_t blocks_y = (height + block_size - 1) / block_size;
+  std::vector<double> sums(blocks_x * blocks_y, 0.0);
+  for (size_t y = 0; y < height; ++y) {
+    double* row = sums.data() + (y / block_size) * blocks_x;
+    for (size_t x = 0; x < width; ++x) {
+      row[x / block_size] += data[y * width + x];
+    }
+  }
+  return sums;
+}
+
+std::vector<double> valueCdf(const std::vector<double>& sums, double total) {
+  std::vector<double> cdf(VALUE_BINS, 0.0);
+  double mean = total / sums.size();
+  for (double value : sums) {
+    double relative = mean > 0 ? value / mean : 0;
+    cdf[std::min(VALUE_BINS - 1, (size_t) (relative * VALUE_BINS / VALUE_RANGE))] += 1.0;
+  }
+  double sum = 0;
+  for (double& bin : cdf) {
+    sum += bin;
+    bin = sum / sums.size();
+  }
+  return cdf;
+}
+
+double median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  size_t mid = values.size() / 2;
+  return values.size() % 2 ? values[mid] : 0.5 * (values[mid - 1] + values[mid]);
+}
+
+}
+
+std::string ChannelDifference::toJson() const {
+  std::ostringstream os;
+  os<<"{\"total_variation\": "<<total_variation<<", \"chi_square\": "<<chi_square
+    <<", \"value_distance\": "<<value_distance<<"}";
+  return os.str();
+}
+
+ChannelDifference compareChannels(const uint32_t* a, const uint32_t* b, size_t width, size_t height,
+                                  size_t block_size) {
+  ChannelDifference result;
+  block_size = std::max((size_t) 1, block_size);
+  std::vector<double> sums_a = blockSums(a, width, height, block_size);
+  std::vector<double> sums_b = blockSums(b, width, height, block_size);
+  double total_a = 0, total_b = 0;
+  for (size_t i = 0; i < sums_a.size(); ++i) {
+    total_a += sums_a[i];
+    total_b += sums_b[i];
+  }
+  if (total_a == 0 || total_b == 0) {
+    //an empty channel only matches another empty one
+    double distance = total_a == total_b ? 0.0 : 1.0;
+    result.total_variation = distance;
+    result.value_distance = distance;
+    return result;
+  }
+
+  double k_a = std::sqrt(total_b / total_a);
+  double k_b = std::sqrt(total_a / total_b);
+  size_t nonempty = 0;
+  for (size_t i = 0; i < sums_a.size(); ++i) {
+    result.total_variation += std::abs(sums_a[i] / total_a - sums_b[i] / total_b);
+    if (sums_a[i] + sums_b[i] > 0) {
+      double diff = sums_a[i] * k_a - sums_b[i] * k_b;
+      result.chi_square += diff * diff / (sums_a[i] + sums_b[i]);
+      nonempty++;
+    }
+  }
+  result.total_variation *= 0.5;
+  result.chi_square /= std::max((size_t) 1, nonempty - 1);
+
+  std::vector<double> cdf_a = valueCdf(sums_a, total_a);
+  std::vector<double> cdf_b = valueCdf(sums_b, total_b);
+  for (size_t i = 0; i < VALUE_BINS; ++i) {
+    result.value_distance = std::max(result.value_distance, std::abs(cdf_a[i] - cdf_b[i]));
+  }
+  return result;
+}
+
+ChannelDifference referenceNoise(const std::vector<const uint32_t*>& references, size_t width, size_t height,
+                                 size_t block_size) {
+  ChannelDifference result;
+  for (size_t i = 0; i < references.size(); ++i) {
+    //the reference held out as if it were a candidate
+    std::vector<const uint32_t*> others;
+    for (size_t j = 0; j < references.size(); ++j) {
+      if (j != i) {
+        others.push_back(references[j]);
+      }
+    }
+    ChannelDifference held_out = differenceFromReferences(references[i], others, width, height, block_size);
+    result.total_variation = std::max(result.total_variation, held_out.total_variation);
+    result.chi_square = std::max(result.chi_square, held_out.chi_square);
+    result.value_distance = std::max(result.value_distance, held_out.value_distance);
+  }
+  return result;
+}
+
+ChannelDifference differenceFromReferences(const uint32_t* candidate, const std::vector<const uint32_t*>& references,
+                                           size_t width, size_t height, size_t block_size) {
+  ChannelDifference result;
+  if (references.empty()) {
+    return result;
+  }
+  std::vector<double> total_variation, chi_square, value_distance;
+  for (const uint32_t* reference : references) {
+    ChannelDifference difference = compareChannels(candidate, reference, width, height, block_size);
+    total_variation.push_back(difference.total_variation);
+    chi_square.push_back(difference.chi_square);
+    value_distance.push_back(difference.value_distance);
+  }
+  result.total_variation = median(total_variation);
+  result.chi_square = median(chi_square);
+  result.value_distance = median(value_distance);
+  return result;
+}
+
+bool withinNoise(const ChannelDifference& candidate, const ChannelDifference& noise, double tolerance) {
+  const double slack = 1e-3;
+  return candidate.total_variation <= tolerance * noise.total_variation + slack &&
+         candidate.chi_square <= tolerance * std::max(1.0, noise.chi_square) &&
+         candidate.value_distance <= tolerance * noise.value_distance + slack;
+}
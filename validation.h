@@ -0,0 +1,39 @@
+#ifndef VALIDATION_H
+#define VALIDATION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//statistics of the difference of two renders of the same channel, both normalized by their total counts
+//sampling noise makes them nonzero even for identical samplers, so they are judged against the same statistics
+//between independent renders of the reference
+struct ChannelDifference {
+  //total variation distance of block sums, 0 for equal distributions, 1 for disjoint ones
+  double total_variation = 0;
+  //two-sample chi-square of block sums per degree of freedom
+  double chi_square = 0;
+  //kolmogorov-smirnov distance of the distributions of block sums relative to their mean
+  double value_distance = 0;
+
+  std::string toJson() const;
+};
+
+//block_size: side of the square blocks whose sums are compared, larger blocks reduce per-pixel noise
+ChannelDifference compareChannels(const uint32_t* a, const uint32_t* b, size_t width, size_t height,
+                                  size_t block_size = 4);
+
+//noise level of independent renders of the reference: each of them is held out and compared with the others like a
+//candidate (see differenceFromReferences), the largest statistics over them
+ChannelDifference referenceNoise(const std::vector<const uint32_t*>& references, size_t width, size_t height,
+                                 size_t block_size = 4);
+//typical difference of a candidate from the references, the median of each statistic over them
+ChannelDifference differenceFromReferences(const uint32_t* candidate, const std::vector<const uint32_t*>& references,
+                                           size_t width, size_t height, size_t block_size = 4);
+
+//true if every statistic of the candidate is at most tolerance times the reference noise,
+//with a small absolute slack for nearly noiseless channels
+bool withinNoise(const ChannelDifference& candidate, const ChannelDifference& noise, double tolerance = 3.0);
+
+#endif